@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <deque>
+#include <memory>
+
+#include "disc.hpp"
+#include "state.hpp"
+
+#include "spdlog/logger.h"
+
+#define CDROM_ACK_DELAY 50401
+#define CDROM_SEEK_DELAY 100000
+#define CDROM_INIT_DELAY 900000
+#define CDROM_GETID_DELAY 33868
+#define CDROM_MAX_PENDING 16
+
+template <size_t N>
+struct Fifo
+{
+    std::array<uint8_t, N> data{};
+    uint16_t head = 0;
+    uint16_t size = 0;
+
+    void Push(uint8_t value)
+    {
+        if (size < N)
+            data[(head + size++) % N] = value;
+    }
+
+    uint8_t Pop()
+    {
+        if (size == 0)
+            return 0;
+        uint8_t value = data[head];
+        head = (head + 1) % N;
+        size--;
+        return value;
+    }
+
+    void Clear()
+    {
+        head = 0;
+        size = 0;
+    }
+
+    bool Empty() const { return size == 0; }
+    bool Full() const { return size == N; }
+    bool Valid() const { return head < N && size <= N; }
+};
+
+class PSX;
+class CDROM
+{
+public:
+    CDROM(PSX *psx);
+
+    void InsertDisc(std::unique_ptr<Disc> disc);
+    bool HasDisc();
+    uint64_t GetDiscHash();
+    void Step(uint32_t cycles);
+
+    uint8_t Read(uint32_t addr);
+    void Write(uint32_t addr, uint8_t value);
+
+    void SaveState(StateWriter &writer);
+    bool LoadState(StateReader &reader);
+
+    const std::deque<int16_t> &GetAudioBuffer();
+    void ClearAudioBuffer();
+    void SetAudioSuppressed(bool suppressed);
+
+private:
+    struct Response
+    {
+        uint8_t irq;
+        uint8_t size;
+        std::array<uint8_t, 16> data;
+    };
+
+    void ExecuteCommand();
+    void ReadNextSector();
+
+    void PushResponse(uint8_t irq, std::initializer_list<uint8_t> data);
+    void QueueResponse(const Response &response);
+    void ScheduleSecondResponse(uint8_t irq, std::initializer_list<uint8_t> data, int32_t delay);
+    void DeliverResponses();
+
+    void ErrorResponse(uint8_t code);
+    uint8_t GetStat();
+
+    void DecodeXA(const uint8_t *sector);
+
+    PSX *psx;
+    spdlog::logger *logger;
+    std::unique_ptr<DiscReader> reader;
+
+    uint8_t index = 0;
+    uint8_t interrupt_enable = 0;
+    uint8_t interrupt_flag = 0;
+    uint8_t mode = 0;
+    uint8_t command = 0;
+
+    bool motor = false;
+    bool reading = false;
+    bool seeking = false;
+    bool muted = false;
+    bool audio_suppressed = false;
+
+    uint8_t filter_file = 0;
+    uint8_t filter_channel = 0;
+
+    uint32_t setloc_lba = 0;
+    uint32_t read_lba = 0;
+
+    int32_t command_timer = 0;
+    int32_t second_timer = 0;
+    int32_t read_timer = 0;
+
+    Fifo<16> parameters;
+    Fifo<16> responses;
+    std::deque<Response> pending_responses;
+    Response second_response{};
+
+    Sector sector{};
+    uint16_t data_index = 0;
+    uint16_t data_size = 0;
+    bool data_ready = false;
+
+    std::array<std::array<int32_t, 2>, 2> xa_history{};
+    std::deque<int16_t> xa_buffer;
+};
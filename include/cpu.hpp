@@ -2,6 +2,12 @@
 
 #include <cstdint>
 #include <array>
+#include <unordered_set>
+
+#include "state.hpp"
+#include "profiler.hpp"
+
+#include "spdlog/logger.h"
 
 #define IMM26(opcode) (opcode & 0x3FFFFFF)
 #define IMM16(opcode) (opcode & 0xFFFF)
@@ -11,8 +17,29 @@
 #define RS(opcode) (opcode >> 21 & 0x1F)
 #define COP(opcode) (opcode >> 21 & 0x1F)
 
+// Optional behaviour the instruction loop is specialised on. Disabled
+// features compile out of the loop, the active specialisation only changes
+// when SR is written or a feature is toggled.
+#define CPU_FEATURE_TRACE 0x1
+#define CPU_FEATURE_PROFILE 0x2
+#define CPU_FEATURE_ISOLATE_CACHE 0x4
+#define CPU_FEATURE_BREAKPOINTS 0x8
+#define CPU_FEATURE_COMBINATIONS 0x10
+
+// Timing model: one cycle per instruction plus memory and multiplier stalls.
+// The instruction cache is only looked up when execution moves to another
+// line, uncached fetches pay the wait states of the region every time.
+#define ICACHE_LINES 256
+#define ICACHE_LINE_SIZE 16
+#define ICACHE_INVALID 0xFFFFFFFF
+#define RAM_ACCESS_CYCLES 5
+#define BIOS_BYTE_CYCLES 6
+#define MMIO_ACCESS_CYCLES 3
+#define DIVIDE_CYCLES 36
+
 enum class ExceptionType : uint8_t
 {
+    Interrupt = 0x0,
     LoadAddressError = 0x4,
     StoreAddressError = 0x5,
     SysCall = 0x8,
@@ -25,21 +52,46 @@ class CPU
 {
 public:
     CPU(PSX *psx);
-    void RunInstruction();
+    // Returns the cycles taken by the instruction, 0 when a breakpoint stopped it from running
+    uint32_t RunInstruction()
+    {
+        return (this->*run_instruction)();
+    }
+    template <uint8_t Features>
+    uint32_t RunInstruction();
+    template <uint8_t Features = 0>
     void RunPrimaryInstruction(uint32_t opcode);
+    template <uint8_t Features = 0>
     void RunSecondaryInstruction(uint32_t opcode);
 
+    uint32_t GetPC();
+    uint32_t GetCurrentPC();
+    uint32_t GetCurrentOpcode();
     uint32_t GetRegister(int index);
     void SetRegister(int index, uint32_t value);
 
     void Exception(ExceptionType type);
 
+    void SaveState(StateWriter &writer);
+    bool LoadState(StateReader &reader);
+
+    void SetProfiler(Profiler *profiler);
+    void SetTracing(bool tracing);
+    void AddBreakpoint(uint32_t addr);
+    void RemoveBreakpoint(uint32_t addr);
+
+    template <uint8_t Features>
     void LB(uint32_t opcode);
+    template <uint8_t Features>
     void LBU(uint32_t opcode);
+    template <uint8_t Features>
     void LW(uint32_t opcode);
 
+    template <uint8_t Features>
     void SB(uint32_t opcode);
+    template <uint8_t Features>
     void SH(uint32_t opcode);
+    template <uint8_t Features>
     void SW(uint32_t opcode);
 
     void ADD(uint32_t opcode);
@@ -63,6 +115,8 @@ public:
     void SRA(uint32_t opcode);
     void LUI(uint32_t opcode);
 
+    void MULT(uint32_t opcode);
+    void MULTU(uint32_t opcode);
     void DIV(uint32_t opcode);
     void DIVU(uint32_t opcode);
     void MFHI(uint32_t opcode);
@@ -71,8 +125,11 @@ public:
     void MTLO(uint32_t opcode);
 
     void J(uint32_t opcode);
+    template <uint8_t Features>
     void JAL(uint32_t opcode);
+    template <uint8_t Features>
     void JR(uint32_t opcode);
+    template <uint8_t Features>
     void JALR(uint32_t opcode);
     void BEQ(uint32_t opcode);
     void BNE(uint32_t opcode);
@@ -89,7 +146,22 @@ public:
     void HandleCoprocessor0(uint32_t opcode);
 
 private:
+    void UpdateFeatures();
+    void FetchLine(uint32_t addr);
+    void InvalidateLine(uint32_t addr);
+    void WaitForMultiplier();
+
     PSX *psx;
+    spdlog::logger *logger;
+    Profiler *profiler = nullptr;
+    bool tracing = false;
+
+    std::unordered_set<uint32_t> breakpoints;
+    bool resuming = false;
+
+    using RunFunction = uint32_t (CPU::*)();
+    static const std::array<RunFunction, CPU_FEATURE_COMBINATIONS> run_functions;
+    RunFunction run_instruction;
 
     struct
     {
@@ -121,10 +193,20 @@ private:
             ExceptionType excode : 5;
         };
     } cause;
-    uint32_t epc;
+    uint32_t epc = 0;
 
+    uint32_t current_pc = 0xBFC00000;
+    uint32_t current_opcode = 0;
     uint32_t next_pc = 0xBFC00004;
     uint32_t pc = 0xBFC00000;
     uint32_t hi = 0x0;
     uint32_t lo = 0x0;
+
+    uint64_t time = 0;
+    uint32_t cycles = 0;
+    uint64_t hilo_ready = 0;
+
+    std::array<uint32_t, ICACHE_LINES> icache_tags;
+    uint32_t fetch_line = ICACHE_INVALID;
+    uint32_t fetch_cycles = 0;
 };
\ No newline at end of file
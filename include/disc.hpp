@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <condition_variable>
+
+#include "libchdr/chd.h"
+#include "spdlog/logger.h"
+
+#define SECTOR_SIZE 2352
+#define SECTORS_PER_SECOND 75
+#define PREGAP_SECTORS 150
+
+enum class TrackType : uint8_t
+{
+    Data,
+    Audio,
+};
+
+enum class Region : uint8_t
+{
+    America,
+    Europe,
+    Japan,
+};
+
+struct Track
+{
+    uint8_t number;
+    TrackType type;
+    uint32_t start;
+    uint32_t length;
+};
+
+using Sector = std::array<uint8_t, SECTOR_SIZE>;
+
+enum class ReadResult : uint8_t
+{
+    Ready,
+    Pending,
+    Failed,
+};
+
+// Images always hand out raw 2352 byte sectors, LBA 0 is 00:02:00
+class Disc
+{
+public:
+    virtual ~Disc() = default;
+
+    virtual bool ReadSector(uint32_t lba, uint8_t *buffer) = 0;
+
+    uint32_t GetSectorCount();
+    Region GetRegion();
+    uint64_t GetHash();
+    const std::vector<Track> &GetTracks();
+
+protected:
+    void Identify();
+
+    spdlog::logger *logger = nullptr;
+    std::vector<Track> tracks;
+    Region region = Region::America;
+    uint64_t hash = 0;
+};
+
+class BinCueDisc : public Disc
+{
+public:
+    bool Open(const std::string &path, spdlog::logger *logger);
+    bool ReadSector(uint32_t lba, uint8_t *buffer) override;
+
+private:
+    bool OpenCue(const std::string &path);
+    bool AddFile(const std::string &path);
+
+    struct File
+    {
+        std::ifstream stream;
+        uint32_t start;
+        uint32_t length;
+    };
+    std::vector<std::unique_ptr<File>> files;
+};
+
+class IsoDisc : public Disc
+{
+public:
+    bool Open(const std::string &path, spdlog::logger *logger);
+    bool ReadSector(uint32_t lba, uint8_t *buffer) override;
+
+private:
+    std::ifstream stream;
+};
+
+// Compressed MAME CHD images. Hunks are decompressed on first use and kept in
+// a small LRU cache, which is only ever touched by the DiscReader's I/O thread,
+// so the emulation thread never pays for decompression.
+class ChdDisc : public Disc
+{
+public:
+    ~ChdDisc() override;
+
+    bool Open(const std::string &path, spdlog::logger *logger);
+    bool ReadSector(uint32_t lba, uint8_t *buffer) override;
+
+private:
+    static constexpr size_t HUNK_CACHE_SIZE = 16;
+
+    bool ReadTracks();
+    const uint8_t *ReadHunk(uint32_t hunk);
+
+    // The stretch of sectors a track keeps in the image, and the frame it starts at
+    struct Extent
+    {
+        uint32_t start;
+        uint32_t length;
+        uint32_t frame;
+        bool audio;
+    };
+    std::vector<Extent> extents;
+
+    chd_file *chd = nullptr;
+    uint32_t hunk_count = 0;
+    uint32_t frames_per_hunk = 0;
+
+    std::list<uint32_t> lru;
+    std::unordered_map<uint32_t, std::pair<std::vector<uint8_t>, std::list<uint32_t>::iterator>> hunks;
+};
+
+std::unique_ptr<Disc> OpenDisc(const std::string &path, spdlog::logger *logger = nullptr);
+
+// Services sector reads on a background thread, reading ahead of the last
+// requested sector into a LRU cache so the emulation thread never waits on
+// host I/O. A miss only schedules the read, the caller retries later. A sector
+// that can't be read is reported once as failed instead of being retried.
+class DiscReader
+{
+public:
+    DiscReader(std::unique_ptr<Disc> disc);
+    ~DiscReader();
+
+    Disc *GetDisc();
+
+    void Prefetch(uint32_t lba);
+    ReadResult TryReadSector(uint32_t lba, uint8_t *buffer);
+
+private:
+    static constexpr uint32_t READ_AHEAD = 32;
+    static constexpr size_t CACHE_SIZE = 256;
+
+    void Worker();
+    bool IsCached(uint32_t lba);
+    void Insert(uint32_t lba, const Sector &sector);
+
+    std::unique_ptr<Disc> disc;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread thread;
+    bool running = true;
+
+    uint32_t request_lba = 0;
+    uint32_t request_generation = 0;
+    uint32_t handled_generation = 0;
+
+    bool read_failed = false;
+    uint32_t failed_lba = 0;
+
+    std::list<uint32_t> lru;
+    std::unordered_map<uint32_t, std::pair<Sector, std::list<uint32_t>::iterator>> cache;
+};
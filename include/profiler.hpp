@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/logger.h"
+
+// Samples the guest PC every N instructions together with a shadow call
+// stack built from JAL/JALR and JR $ra, and counts every executed opcode.
+// Frames are function entry points, so even without symbols the output
+// groups samples by guest function.
+class Profiler
+{
+public:
+    Profiler(int interval, spdlog::logger *logger);
+
+    bool LoadSymbols(const std::string &path);
+    void LoadBIOSSymbols();
+
+    void OnInstruction(uint32_t pc, uint32_t opcode)
+    {
+        if (opcode >> 26)
+            primary_counts[opcode >> 26]++;
+        else
+            secondary_counts[opcode & 0x3F]++;
+
+        if (--countdown == 0)
+        {
+            countdown = interval;
+            Sample(pc);
+        }
+    }
+
+    void OnCall(uint32_t target, uint32_t return_addr, uint32_t function);
+    void OnReturn(uint32_t target);
+
+    bool WriteFoldedStacks(const std::string &path);
+    bool WriteReport(const std::string &path);
+
+private:
+    struct Frame
+    {
+        uint64_t function;
+        uint32_t return_addr;
+    };
+
+    void Sample(uint32_t pc);
+    uint64_t FindFunction(uint32_t pc);
+    std::string GetName(uint64_t function);
+    bool LoadELFSymbols(const std::vector<uint8_t> &elf);
+
+    spdlog::logger *logger;
+    int interval;
+    int countdown;
+
+    std::array<uint64_t, 64> primary_counts{};
+    std::array<uint64_t, 64> secondary_counts{};
+
+    std::vector<Frame> stack;
+    std::map<std::vector<uint64_t>, uint64_t> samples;
+
+    std::map<uint32_t, std::string> symbols;
+    std::unordered_map<uint32_t, std::string> bios_symbols;
+};
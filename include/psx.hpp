@@ -1,16 +1,123 @@
 #pragma once
 
 #include <cstdint>
+#include <array>
+#include <chrono>
+#include <bitset>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_set>
 
 #include "cpu.hpp"
+#include "cdrom.hpp"
+#include "state.hpp"
+#include "rewind.hpp"
+#include "trace.hpp"
+#include "stats.hpp"
+
+#include "spdlog/logger.h"
+
+// Bumped whenever emulation results change, so nothing produced by an older core is reused
+#define CORE_REVISION 2
+
+#define CPU_CLOCK 33868800
+#define CYCLES_PER_FRAME (CPU_CLOCK / 60)
+#define FRAME_DURATION std::chrono::nanoseconds(1000000000 / 60)
+
+#define BIOS_SIZE 0x80000
+#define RAM_SIZE 0x200000
+#define RAM_PAGE_SIZE 0x1000
+#define RAM_PAGES (RAM_SIZE / RAM_PAGE_SIZE)
+#define SCRATCHPAD_SIZE 0x400
+
+enum class Interrupt : uint8_t
+{
+    VBlank = 0,
+    GPU = 1,
+    CDROM = 2,
+    DMA = 3,
+    Timer0 = 4,
+    Timer1 = 5,
+    Timer2 = 6,
+    Controller = 7,
+    SIO = 8,
+    SPU = 9,
+    Lightpen = 10,
+};
+
+enum class StopReason : uint8_t
+{
+    None,
+    UnknownMemoryRead,
+    UnknownMemoryWrite,
+    UnknownInstruction,
+    UnknownCoprocessorRegister,
+    UnsupportedStatusRegister,
+    InstructionBudget,
+    FrameBudget,
+    Breakpoint,
+};
+
+const char *GetStopReasonName(StopReason reason);
 
 class PSX
 {
 public:
-    PSX(uint8_t *bios);
+    PSX(uint8_t *bios, std::shared_ptr<spdlog::logger> logger = nullptr);
     ~PSX();
 
-    void Run();
+    StopReason Run(uint64_t max_instructions = 0, uint64_t max_frames = 0);
+    void RunFrame();
+    bool RunUntil(uint32_t addr, uint64_t max_cycles);
+
+    void Stop(StopReason reason);
+    StopReason GetStopReason();
+    uint64_t GetInstructionCount();
+    uint64_t GetFrameCount();
+
+    spdlog::logger *GetLogger();
+
+    void InsertDisc(std::unique_ptr<Disc> disc);
+    bool HasDisc();
+    uint64_t GetDiscHash();
+    uint64_t GetBIOSHash();
+
+    void SaveState(StateWriter &writer, bool include_ram = true);
+    bool LoadState(StateReader &reader, bool include_ram = true);
+    bool SaveStateToFile(const std::string &path);
+    bool LoadStateFromFile(const std::string &path);
+
+    void EnableRewind(size_t capacity, int interval);
+    bool StepBack();
+
+    void EnableRunAhead(int frames);
+    void SetFastForward(bool enabled);
+
+    Profiler *EnableProfiler(int interval);
+
+    void AddBreakpoint(uint32_t addr);
+    void RemoveBreakpoint(uint32_t addr);
+
+    bool PublishStats(const std::string &path);
+    Stats &GetStats()
+    {
+        return *stats;
+    }
+
+    bool EnableTrace(const std::string &path);
+    void Trace(TraceEvent event, uint32_t addr, uint32_t value, uint16_t size = 0)
+    {
+        if (trace && !speculating)
+            trace->Record(event, instructions, cpu->GetCurrentPC(), cpu->GetCurrentOpcode(), addr, value, size);
+    }
+
+    uint8_t *GetRAM();
+    bool MapRAM(int fd);
+    std::bitset<RAM_PAGES> &GetDirtyPages();
+
+    void RequestInterrupt(Interrupt interrupt);
+    bool InterruptPending();
 
     uint8_t ReadMemory8(uint32_t addr);
     uint16_t ReadMemory16(uint32_t addr);
@@ -23,7 +130,48 @@ public:
     uint32_t MirrorAddress(uint32_t addr);
 
 private:
+    void EmulateFrame();
+    void RunAheadFrame();
+    void Throttle();
+    void UnimplementedWrite(const char *name, uint32_t addr, uint32_t value, uint16_t size);
+    void UpdateStats();
+    bool ReadState(StateReader &reader, bool include_ram);
+
+    std::shared_ptr<spdlog::logger> logger;
+
     uint8_t *bios;
+    uint64_t bios_hash;
     uint8_t *ram;
+    bool ram_mapped = false;
+    std::array<uint8_t, SCRATCHPAD_SIZE> scratchpad{};
+    std::bitset<RAM_PAGES> dirty_pages;
     CPU *cpu;
+    CDROM *cdrom;
+
+    uint32_t i_stat = 0;
+    uint32_t i_mask = 0;
+
+    StopReason stop_reason = StopReason::None;
+    uint64_t instructions = 0;
+    uint64_t instruction_limit = 0;
+    uint64_t frames = 0;
+    uint32_t frame_cycles = 0;
+
+    StateWriter load_backup;
+    std::unique_ptr<RewindBuffer> rewind;
+
+    int run_ahead_frames = 0;
+    bool speculating = false;
+    StateWriter run_ahead_state;
+    std::vector<uint8_t> run_ahead_ram;
+
+    bool fast_forward = true;
+    std::chrono::steady_clock::time_point frame_deadline;
+    std::unique_ptr<Profiler> profiler;
+    std::unique_ptr<TraceBuffer> trace;
+    std::unordered_set<uint32_t> reported_registers;
+
+    Stats local_stats;
+    Stats *stats = &local_stats;
+    Stats speculative_stats;
 };
\ No newline at end of file
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "state.hpp"
+
+class PSX;
+
+// Keeps a memory bounded history of snapshots for stepping backwards.
+// Only the newest snapshot is kept in full; every older one is stored as
+// the compressed XOR delta to its successor. Capturing copies the RAM pages
+// written since the last snapshot, the diffing and compression happen on a
+// worker thread. Memory usage counts the full shadow copy of the newest
+// snapshot as well as the deltas.
+class RewindBuffer
+{
+public:
+    RewindBuffer(PSX *psx, size_t capacity, int interval);
+    ~RewindBuffer();
+
+    void OnFrame();
+    bool StepBack();
+
+    size_t GetSnapshotCount();
+    size_t GetMemoryUsage();
+
+private:
+    struct Capture
+    {
+        std::vector<uint8_t> device;
+        std::vector<uint16_t> pages;
+        std::vector<uint8_t> ram;
+    };
+
+    struct Snapshot
+    {
+        uint32_t device_size;
+        uint32_t device_delta_size;
+        std::vector<uint8_t> data;
+    };
+
+    void Take();
+    void Worker();
+    void Process(Capture &capture);
+    void Flush();
+    bool Restore();
+
+    static void EncodeDelta(const uint8_t *current, const uint8_t *previous, size_t size, std::vector<uint8_t> &out);
+    static const uint8_t *ApplyDelta(const uint8_t *delta, uint8_t *target, size_t size);
+
+    PSX *psx;
+    size_t capacity;
+    int interval;
+    int frames = 0;
+
+    // Instruction count when the newest snapshot was captured or restored
+    uint64_t position = 0;
+
+    StateWriter writer;
+
+    std::vector<uint8_t> shadow_ram;
+    std::vector<uint8_t> shadow_device;
+    bool has_base = false;
+
+    std::deque<Snapshot> snapshots;
+    size_t memory_usage = 0;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable idle;
+    std::thread thread;
+    std::deque<Capture> queue;
+    bool busy = false;
+    bool running = true;
+};
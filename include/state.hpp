@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/logger.h"
+
+#define STATE_MAGIC 0x53585350
+#define STATE_VERSION 1
+
+// Save states are a header followed by tagged sections, one per component.
+// Every section carries its own version so devices can evolve separately,
+// and unknown sections are skipped by the reader.
+struct StateHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sections;
+};
+
+struct SectionHeader
+{
+    char id[4];
+    uint32_t version;
+    uint32_t size;
+};
+
+class StateWriter
+{
+public:
+    StateWriter();
+
+    void Reset();
+
+    void BeginSection(const char *id, uint32_t version);
+    void EndSection();
+
+    void WriteBytes(const void *data, size_t size);
+
+    template <typename T>
+    void Write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        WriteBytes(&value, sizeof(T));
+    }
+
+    const uint8_t *GetData();
+    size_t GetSize();
+
+private:
+    std::vector<uint8_t> buffer;
+    size_t size = 0;
+    size_t section_start = 0;
+    uint32_t sections = 0;
+};
+
+class StateReader
+{
+public:
+    StateReader(const uint8_t *data, size_t size, spdlog::logger *logger = nullptr);
+
+    bool IsValid();
+
+    bool OpenSection(const char *id, uint32_t max_version, uint32_t &version);
+    bool ReadBytes(void *data, size_t size);
+
+    template <typename T>
+    bool Read(T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return ReadBytes(&value, sizeof(T));
+    }
+
+private:
+    struct Section
+    {
+        uint32_t version;
+        size_t offset;
+        size_t size;
+    };
+
+    const uint8_t *data;
+    spdlog::logger *logger;
+    bool valid = false;
+    size_t position = 0;
+    size_t section_end = 0;
+    std::unordered_map<std::string, Section> sections;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+#define STATS_MAGIC 0x54535350 // "PSST"
+#define STATS_VERSION 1
+#define STATS_NAME_SIZE 48
+#define EXCEPTION_TYPES 32
+
+enum class MemoryRegion : uint8_t
+{
+    RAM,
+    BIOS,
+    Scratchpad,
+    MMIO,
+    Count,
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// Counters of one instance. When published this lives at the start of a
+// shared file mapping, so it only holds fixed size fields and lock free
+// atomics. Readers may see counters from slightly different moments.
+struct Stats
+{
+    uint32_t magic = STATS_MAGIC;
+    uint32_t version = STATS_VERSION;
+    int32_t pid = 0;
+    char name[STATS_NAME_SIZE]{};
+
+    std::atomic<uint32_t> stop_reason = 0;
+    std::atomic<uint64_t> updated = 0; // system clock nanoseconds
+    std::atomic<uint64_t> instructions = 0;
+    std::atomic<uint64_t> frames = 0;
+    std::atomic<uint64_t> frame_time = 0; // host nanoseconds of the last frame
+    std::atomic<uint64_t> total_frame_time = 0;
+    std::atomic<uint64_t> unimplemented_registers = 0;
+    std::atomic<uint64_t> exceptions[EXCEPTION_TYPES]{};
+    std::atomic<uint64_t> reads[(int)MemoryRegion::Count]{};
+    std::atomic<uint64_t> writes[(int)MemoryRegion::Count]{};
+};
+
+// There is only ever one writer, so no locked read-modify-write is needed
+inline void Increment(std::atomic<uint64_t> &counter)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+inline MemoryRegion GetMemoryRegion(uint32_t addr)
+{
+    addr &= 0x1FFFFFFF;
+    if (addr < 0x800000)
+        return MemoryRegion::RAM;
+    else if (addr >= 0x1FC00000 && addr < 0x1FC80000)
+        return MemoryRegion::BIOS;
+    else if (addr >= 0x1F800000 && addr < 0x1F800400)
+        return MemoryRegion::Scratchpad;
+    return MemoryRegion::MMIO;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRACE_MAGIC 0x54585350 // "PSXT"
+#define TRACE_VERSION 1
+#define TRACE_CAPACITY 0x10000
+
+enum class TraceEvent : uint16_t
+{
+    CacheIsolatedLoad,
+    CacheIsolatedStore,
+    UnimplementedWrite,
+    Exception,
+    Interrupt,
+    CDROMCommand,
+};
+
+const char *GetTraceEventName(TraceEvent event);
+
+struct TraceFileHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+};
+
+struct TraceRecord
+{
+    uint64_t instruction;
+    uint32_t pc;
+    uint32_t opcode;
+    uint32_t addr;
+    uint32_t value;
+    TraceEvent event;
+    uint16_t size;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 32);
+
+// Single producer ring of fixed size records. The emulation thread only
+// writes a record and publishes the head, a background thread drains the
+// ring to the trace file. When the drain falls behind records are dropped
+// and counted instead of stalling the emulation.
+class TraceBuffer
+{
+public:
+    TraceBuffer(const std::string &path, size_t capacity = TRACE_CAPACITY);
+    ~TraceBuffer();
+
+    bool IsOpen();
+    uint64_t GetDropped();
+
+    void Record(TraceEvent event, uint64_t instruction, uint32_t pc, uint32_t opcode, uint32_t addr, uint32_t value, uint16_t size = 0)
+    {
+        uint64_t position = head.load(std::memory_order_relaxed);
+        if (position - tail.load(std::memory_order_acquire) == records.size())
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        records[position & (records.size() - 1)] = {instruction, pc, opcode, addr, value, event, size, 0};
+        head.store(position + 1, std::memory_order_release);
+    }
+
+private:
+    void Worker();
+    void Drain();
+
+    std::vector<TraceRecord> records;
+    alignas(64) std::atomic<uint64_t> head = 0;
+    alignas(64) std::atomic<uint64_t> tail = 0;
+    alignas(64) std::atomic<uint64_t> dropped = 0;
+
+    std::ofstream file;
+    bool open = false;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread thread;
+    bool running = true;
+};
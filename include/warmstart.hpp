@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "disc.hpp"
+
+#include "spdlog/logger.h"
+
+class PSX;
+
+// A frozen machine state that new instances can be started from without
+// booting the BIOS again. On Linux the RAM image lives in a memfd which every
+// spawned instance maps privately, so instances share pages until they write
+// to them. States remember their disc, so an image taken with a disc inserted
+// needs the same disc to spawn from.
+class WarmImage
+{
+public:
+    WarmImage(PSX *psx);
+    ~WarmImage();
+
+    std::unique_ptr<PSX> Spawn(uint8_t *bios, std::shared_ptr<spdlog::logger> logger = nullptr, std::unique_ptr<Disc> disc = nullptr);
+
+private:
+    std::vector<uint8_t> device;
+    std::vector<uint8_t> ram;
+    int fd = -1;
+};
+
+// Brings the machine to addr, reusing the result of an earlier boot with the
+// same BIOS and disc from cache_directory when there is one. Entries are named
+// after the core revision, BIOS hash, boot address and disc hash and are
+// checked against the BIOS again on load. An entry that fails to load is
+// removed and false is returned, the machine itself is left as it was.
+bool BootCached(PSX &psx, const std::string &cache_directory, uint32_t addr, uint64_t max_cycles);
@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "psx.hpp"
+#include "warmstart.hpp"
+
+#include "spdlog/spdlog.h"
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+
+#define SHELL_ENTRY 0x80030000
+#define BOOT_TIMEOUT 60
+#define REWIND_CAPACITY (16 << 20)
+#define REWIND_INTERVAL 60
+
+struct Job
+{
+    std::string name;
+    std::string bios;
+    std::string disc;
+    std::string state;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+
+    // Which warm start image the job spawns from, empty for a cold boot
+    std::string image;
+};
+
+struct Result
+{
+    StopReason reason = StopReason::None;
+    std::string error;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+    double seconds = 0.0;
+};
+
+// Job names and error messages end up in JSON strings
+static std::string EscapeJSON(const std::string &text)
+{
+    std::string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if ((unsigned char)c < 0x20)
+            escaped += fmt::format("\\u{:04x}", (unsigned char)c);
+        else
+            escaped += c;
+    }
+    return escaped;
+}
+
+// Counts have to be plain decimal numbers, anything else is a typo in the job file
+static bool ParseCount(const std::string &text, uint64_t &count)
+{
+    auto end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, count);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+// Jobs are one per line: a name followed by key=value pairs, e.g.
+// boot bios=scph1001.bin disc=game.cue state=warm.state frames=600
+bool ParseJobs(const char *path, std::vector<Job> &jobs)
+{
+    std::ifstream file(path);
+    if (file.fail())
+    {
+        std::cerr << "Failed to open job file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++)
+    {
+        std::istringstream tokens(line);
+        Job job;
+        if (!(tokens >> job.name) || job.name[0] == '#')
+            continue;
+
+        std::string token;
+        while (tokens >> token)
+        {
+            auto separator = token.find('=');
+            auto key = token.substr(0, separator);
+            auto value = separator == std::string::npos ? "" : token.substr(separator + 1);
+
+            if (key == "bios")
+                job.bios = value;
+            else if (key == "disc")
+                job.disc = value;
+            else if (key == "state")
+                job.state = value;
+            else if (key == "instructions" || key == "frames")
+            {
+                if (!ParseCount(value, key == "frames" ? job.frames : job.instructions))
+                {
+                    std::cerr << path << ":" << number << ": invalid " << key << " count " << value << std::endl;
+                    return false;
+                }
+            }
+            else
+            {
+                std::cerr << path << ":" << number << ": unknown job option " << key << std::endl;
+                return false;
+            }
+        }
+
+        if (job.bios.empty() || (!job.instructions && !job.frames))
+        {
+            std::cerr << path << ":" << number << ": jobs need a bios and an instruction or frame budget" << std::endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: psx_batch [job file] [--threads count] [--output results] [--log-level level] [--stats directory] [--boot-cache directory] [--rewind directory]" << std::endl;
+        return 1;
+    }
+
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    const char *output_path = nullptr;
+    std::string stats_directory;
+    std::string boot_cache;
+    std::string rewind_directory;
+    auto log_level = spdlog::level::warn;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads")
+        {
+            uint64_t count;
+            if (!ParseCount(argv[i + 1], count))
+            {
+                std::cerr << "Invalid thread count " << argv[i + 1] << std::endl;
+                return 1;
+            }
+            threads = std::clamp<uint64_t>(count, 1, UINT32_MAX);
+        }
+        else if (arg == "--output")
+            output_path = argv[i + 1];
+        else if (arg == "--log-level")
+            log_level = spdlog::level::from_str(argv[i + 1]);
+        else if (arg == "--stats")
+            stats_directory = argv[i + 1];
+        else if (arg == "--boot-cache")
+            boot_cache = argv[i + 1];
+        else if (arg == "--rewind")
+            rewind_directory = argv[i + 1];
+    }
+
+    std::vector<Job> jobs;
+    if (!ParseJobs(argv[1], jobs))
+        return 1;
+
+    // BIOS images and warm start images are shared read-only by all jobs using them
+    std::map<std::string, std::vector<uint8_t>> bioses;
+    std::map<std::pair<std::string, std::string>, std::unique_ptr<WarmImage>> images;
+    for (auto &job : jobs)
+    {
+        auto &bios = bioses[job.bios];
+        if (bios.empty())
+        {
+            std::ifstream file(job.bios, std::ios::binary);
+            bios.assign(std::istreambuf_iterator<char>(file), {});
+            if (bios.size() != BIOS_SIZE)
+            {
+                std::cerr << "Invalid BIOS rom " << job.bios << std::endl;
+                return 1;
+            }
+        }
+
+        // Jobs without a state boot through the cache once per BIOS and disc. An image keeps the disc it
+        // was made with in its device state, so every image key tells discs apart by their contents.
+        auto disc = job.disc.empty() ? nullptr : OpenDisc(job.disc);
+        job.image = job.state;
+        if (job.state.empty() && !boot_cache.empty())
+            job.image = ":boot";
+        if (!job.image.empty() && disc)
+            job.image += fmt::format(":{:016X}", disc->GetHash());
+
+        auto &image = images[{job.bios, job.image}];
+        if (job.image.empty() || image)
+            continue;
+
+        PSX psx(bios.data());
+        if (disc)
+            psx.InsertDisc(std::move(disc));
+        if (!job.state.empty() && !psx.LoadStateFromFile(job.state))
+        {
+            std::cerr << "Invalid save state " << job.state << std::endl;
+            return 1;
+        }
+        if (job.state.empty() && !BootCached(psx, boot_cache, SHELL_ENTRY, (uint64_t)CPU_CLOCK * BOOT_TIMEOUT))
+        {
+            std::cerr << "Failed to boot " << job.bios << " through the boot cache" << std::endl;
+            return 1;
+        }
+        image = std::make_unique<WarmImage>(&psx);
+    }
+
+    auto sink = std::make_shared<spdlog::sinks::stderr_color_sink_mt>();
+    std::vector<Result> results(jobs.size());
+    std::atomic<size_t> next_job = 0;
+
+    auto worker = [&]()
+    {
+        for (size_t index = next_job++; index < jobs.size(); index = next_job++)
+        {
+            auto &job = jobs[index];
+            auto &result = results[index];
+
+            auto logger = std::make_shared<spdlog::logger>(job.name, sink);
+            logger->set_level(log_level);
+
+            auto start = std::chrono::steady_clock::now();
+
+            std::unique_ptr<Disc> disc;
+            if (!job.disc.empty())
+            {
+                disc = OpenDisc(job.disc, logger.get());
+                if (!disc)
+                {
+                    result.error = "invalid disc image";
+                    continue;
+                }
+            }
+
+            // The disc goes in before the image is loaded, states only load with the disc they were made with
+            uint8_t *bios = bioses.at(job.bios).data();
+            auto &image = images.at({job.bios, job.image});
+            std::unique_ptr<PSX> psx;
+            if (image)
+                psx = image->Spawn(bios, logger, std::move(disc));
+            else
+            {
+                psx = std::make_unique<PSX>(bios, logger);
+                if (disc)
+                    psx->InsertDisc(std::move(disc));
+            }
+            if (!psx)
+            {
+                result.error = "failed to start from warm image";
+                continue;
+            }
+
+            // Published per job so psx_top can watch the whole batch while it runs
+            if (!stats_directory.empty())
+                psx->PublishStats(stats_directory + "/" + job.name + ".stats");
+
+            if (!rewind_directory.empty())
+                psx->EnableRewind(REWIND_CAPACITY, REWIND_INTERVAL);
+
+            result.reason = psx->Run(job.instructions, job.frames);
+            result.instructions = psx->GetInstructionCount();
+            result.frames = psx->GetFrameCount();
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            // Failed jobs leave the machine from shortly before the failure behind for a closer look
+            bool budget = result.reason == StopReason::InstructionBudget || result.reason == StopReason::FrameBudget;
+            if (!rewind_directory.empty() && !budget && psx->StepBack())
+                psx->SaveStateToFile(rewind_directory + "/" + job.name + ".state");
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 0; i < std::min<size_t>(threads, jobs.size()); i++)
+        pool.emplace_back(worker);
+    for (auto &thread : pool)
+        thread.join();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream output_file;
+    if (output_path)
+        output_file.open(output_path);
+    std::ostream &output = output_path ? output_file : std::cout;
+
+    int failures = 0;
+    uint64_t total_instructions = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        auto &result = results[i];
+        bool success = result.error.empty() && (result.reason == StopReason::InstructionBudget || result.reason == StopReason::FrameBudget);
+        failures += !success;
+        total_instructions += result.instructions;
+
+        output << "{\"job\":\"" << EscapeJSON(jobs[i].name) << "\""
+               << ",\"success\":" << (success ? "true" : "false")
+               << ",\"stop\":\"" << EscapeJSON(result.error.empty() ? GetStopReasonName(result.reason) : result.error) << "\""
+               << ",\"instructions\":" << result.instructions
+               << ",\"frames\":" << result.frames
+               << ",\"seconds\":" << result.seconds << "}" << std::endl;
+    }
+
+    std::cerr << jobs.size() << " jobs, " << failures << " failed, " << elapsed << "s, "
+              << total_instructions / elapsed / 1e6 << " MIPS across " << pool.size() << " threads" << std::endl;
+
+    return failures ? 1 : 0;
+}
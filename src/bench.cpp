@@ -0,0 +1,258 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "psx.hpp"
+
+#include "spdlog/spdlog.h"
+
+static std::atomic<uint64_t> allocations = 0;
+
+// Only counts, the matching deletes below release with free(). They are kept out of line,
+// otherwise GCC sees free() called on memory from operator new and warns about a mismatch.
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *pointer = std::malloc(size ? size : 1))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+struct Measurement
+{
+    std::string name;
+    uint64_t iterations;
+    double seconds;
+    uint64_t allocations;
+    bool instructions;
+};
+
+static std::vector<Measurement> measurements;
+static volatile uint32_t sink;
+
+template <typename F>
+void Measure(const std::string &name, uint64_t iterations, bool instructions, F &&body)
+{
+    // One untimed pass so lazily created state doesn't end up in the numbers
+    body(iterations / 10 + 1);
+
+    uint64_t allocations_before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    body(iterations);
+    auto end = std::chrono::steady_clock::now();
+    uint64_t allocated = allocations.load() - allocations_before;
+
+    measurements.push_back({name, iterations, std::chrono::duration<double>(end - start).count(), allocated, instructions});
+}
+
+// A small loop mixing loads, stores, ALU ops and branches, placed at the reset vector
+static std::vector<uint8_t> CreateSyntheticBIOS()
+{
+    const uint32_t program[] = {
+        0x3C088001, // lui   $t0, 0x8001
+        0x8D090000, // lw    $t1, 0($t0)
+        0x25290003, // addiu $t1, $t1, 3
+        0xAD090000, // sw    $t1, 0($t0)
+        0x00095080, // sll   $t2, $t1, 2
+        0x01495825, // or    $t3, $t2, $t1
+        0x2D6C0064, // sltiu $t4, $t3, 100
+        0x15800001, // bne   $t4, $zero, 1
+        0x00000000, // nop
+        0x0BF00001, // j     0xBFC00004
+        0x00000000, // nop
+    };
+
+    std::vector<uint8_t> bios(BIOS_SIZE);
+    std::memcpy(bios.data(), program, sizeof(program));
+    return bios;
+}
+
+static void MemoryBenchmarks(PSX &psx)
+{
+    const uint64_t iterations = 10000000;
+
+    struct Region
+    {
+        const char *name;
+        uint32_t addr;
+    };
+    const Region regions[] = {
+        {"kuseg_ram", 0x00010000},
+        {"kseg0_ram", 0x80010000},
+        {"kseg1_ram", 0xA0010000},
+        {"bios", 0xBFC00000},
+        {"expansion", 0x1F000000},
+    };
+
+    for (auto &region : regions)
+    {
+        std::string name = region.name;
+        uint32_t addr = region.addr;
+
+        Measure("read8_" + name, iterations, false, [&](uint64_t count)
+                { for (uint64_t i = 0; i < count; i++) sink = psx.ReadMemory8(addr + (i & 0xFC)); });
+        if (name == "expansion")
+            continue;
+
+        Measure("read16_" + name, iterations, false, [&](uint64_t count)
+                { for (uint64_t i = 0; i < count; i++) sink = psx.ReadMemory16(addr + (i & 0xFC)); });
+        Measure("read32_" + name, iterations, false, [&](uint64_t count)
+                { for (uint64_t i = 0; i < count; i++) sink = psx.ReadMemory32(addr + (i & 0xFC)); });
+        if (name == "bios")
+            continue;
+
+        Measure("write8_" + name, iterations, false, [&](uint64_t count)
+                { for (uint64_t i = 0; i < count; i++) psx.WriteMemory8(addr + (i & 0xFC), i); });
+        Measure("write16_" + name, iterations, false, [&](uint64_t count)
+                { for (uint64_t i = 0; i < count; i++) psx.WriteMemory16(addr + (i & 0xFC), i); });
+        Measure("write32_" + name, iterations, false, [&](uint64_t count)
+                { for (uint64_t i = 0; i < count; i++) psx.WriteMemory32(addr + (i & 0xFC), i); });
+    }
+
+    Measure("mmio_read32_irq_stat", iterations, false, [&](uint64_t count)
+            { for (uint64_t i = 0; i < count; i++) sink = psx.ReadMemory32(0x1F801070); });
+    Measure("mmio_write32_irq_mask", iterations, false, [&](uint64_t count)
+            { for (uint64_t i = 0; i < count; i++) psx.WriteMemory32(0x1F801074, 0); });
+    Measure("mmio_read8_cdrom_status", iterations, false, [&](uint64_t count)
+            { for (uint64_t i = 0; i < count; i++) sink = psx.ReadMemory8(0x1F801800); });
+}
+
+static void CPUBenchmarks(PSX &psx)
+{
+    const uint64_t iterations = 10000000;
+    CPU cpu(&psx);
+
+    struct Instruction
+    {
+        const char *name;
+        uint32_t opcode;
+    };
+    const Instruction instructions[] = {
+        {"addiu", 0x25290003},
+        {"lui", 0x3C088001},
+        {"sltiu", 0x2D6C0064},
+        {"bne", 0x15800001},
+        {"sll", 0x00095080},
+        {"or", 0x01495825},
+        {"addu", 0x01495821},
+    };
+
+    for (auto &instruction : instructions)
+    {
+        uint32_t opcode = instruction.opcode;
+        if (opcode >> 26)
+            Measure(std::string("dispatch_") + instruction.name, iterations, false, [&](uint64_t count)
+                    { for (uint64_t i = 0; i < count; i++) cpu.RunPrimaryInstruction(opcode); });
+        else
+            Measure(std::string("dispatch_") + instruction.name, iterations, false, [&](uint64_t count)
+                    { for (uint64_t i = 0; i < count; i++) cpu.RunSecondaryInstruction(opcode); });
+    }
+
+    Measure("exception_entry", iterations, false, [&](uint64_t count)
+            { for (uint64_t i = 0; i < count; i++) cpu.Exception(ExceptionType::SysCall); });
+}
+
+static void MacroBenchmark(const std::string &name, uint8_t *bios, uint64_t instructions)
+{
+    auto logger = std::make_shared<spdlog::logger>(name);
+    PSX psx(bios, logger);
+
+    uint64_t allocations_before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    StopReason reason = psx.Run(instructions);
+    auto end = std::chrono::steady_clock::now();
+    uint64_t allocated = allocations.load() - allocations_before;
+
+    if (reason != StopReason::InstructionBudget)
+        std::cerr << name << " stopped early: " << GetStopReasonName(reason) << std::endl;
+
+    measurements.push_back({name, psx.GetInstructionCount(), std::chrono::duration<double>(end - start).count(), allocated, true});
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *bios_path = nullptr;
+    const char *output_path = nullptr;
+    uint64_t instructions = 50000000;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if (arg == "--bios")
+            bios_path = argv[i + 1];
+        else if (arg == "--output")
+            output_path = argv[i + 1];
+        else if (arg == "--instructions")
+            instructions = std::stoull(argv[i + 1]);
+        else
+        {
+            std::cerr << "Usage: psx_bench [--bios bios rom] [--instructions count] [--output results]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Logging would dominate anything it touches, the benchmarks only care about the happy path
+    spdlog::set_level(spdlog::level::off);
+
+    auto synthetic = CreateSyntheticBIOS();
+    {
+        PSX psx(synthetic.data());
+        MemoryBenchmarks(psx);
+        CPUBenchmarks(psx);
+    }
+
+    MacroBenchmark("synthetic_program", synthetic.data(), instructions);
+
+    if (bios_path)
+    {
+        std::ifstream file(bios_path, std::ios::binary);
+        std::vector<uint8_t> bios(std::istreambuf_iterator<char>(file), {});
+        if (bios.size() != BIOS_SIZE)
+        {
+            std::cerr << "Invalid BIOS rom" << std::endl;
+            return 1;
+        }
+        MacroBenchmark("bios_boot", bios.data(), instructions);
+    }
+
+    std::ofstream output_file;
+    if (output_path)
+        output_file.open(output_path);
+    std::ostream &output = output_path ? output_file : std::cout;
+
+    output << "{\"benchmarks\":[" << std::endl;
+    for (size_t i = 0; i < measurements.size(); i++)
+    {
+        auto &measurement = measurements[i];
+        double ns = measurement.seconds * 1e9 / measurement.iterations;
+
+        output << "  {\"name\":\"" << measurement.name << "\""
+               << ",\"iterations\":" << measurement.iterations
+               << ",\"seconds\":" << measurement.seconds
+               << ",\"ns_per_op\":" << ns
+               << ",\"allocations\":" << measurement.allocations;
+        if (measurement.instructions)
+            output << ",\"guest_mips\":" << measurement.iterations / measurement.seconds / 1e6;
+        output << "}" << (i + 1 < measurements.size() ? "," : "") << std::endl;
+    }
+    output << "]}" << std::endl;
+
+    return 0;
+}
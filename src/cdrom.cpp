@@ -0,0 +1,625 @@
+#include "cdrom.hpp"
+#include "psx.hpp"
+
+#include <algorithm>
+
+#include "spdlog/spdlog.h"
+
+#define CDROM_RETRY_DELAY 2000
+#define XA_BUFFER_LIMIT 37800 * 2
+
+static uint8_t FromBCD(uint8_t value)
+{
+    return (value >> 4) * 10 + (value & 0xF);
+}
+
+static uint8_t ToBCD(uint8_t value)
+{
+    return (value / 10) << 4 | value % 10;
+}
+
+CDROM::CDROM(PSX *psx) : psx(psx), logger(psx->GetLogger())
+{
+}
+
+void CDROM::InsertDisc(std::unique_ptr<Disc> disc)
+{
+    reader = std::make_unique<DiscReader>(std::move(disc));
+    reader->Prefetch(0);
+}
+
+bool CDROM::HasDisc()
+{
+    return reader != nullptr;
+}
+
+uint64_t CDROM::GetDiscHash()
+{
+    return reader ? reader->GetDisc()->GetHash() : 0;
+}
+
+void CDROM::Step(uint32_t cycles)
+{
+    if (command_timer > 0)
+    {
+        command_timer -= cycles;
+        if (command_timer <= 0)
+        {
+            command_timer = 0;
+            ExecuteCommand();
+        }
+    }
+
+    if (second_timer > 0)
+    {
+        second_timer -= cycles;
+        if (second_timer <= 0)
+        {
+            second_timer = 0;
+            QueueResponse(second_response);
+        }
+    }
+
+    if (read_timer > 0)
+    {
+        read_timer -= cycles;
+        if (read_timer <= 0)
+            ReadNextSector();
+    }
+
+    if (!pending_responses.empty())
+        DeliverResponses();
+}
+
+uint8_t CDROM::Read(uint32_t addr)
+{
+    switch (addr & 0x3)
+    {
+    case 0x0:
+        return index |
+               parameters.Empty() << 3 |
+               !parameters.Full() << 4 |
+               !responses.Empty() << 5 |
+               (data_index < data_size) << 6 |
+               (command_timer > 0) << 7;
+    case 0x1:
+        return responses.Pop();
+    case 0x2:
+        if (data_index >= data_size)
+            return 0;
+        return sector[data_index++];
+    default:
+        if (index & 1)
+            return interrupt_flag | 0xE0;
+        return interrupt_enable | 0xE0;
+    }
+}
+
+void CDROM::Write(uint32_t addr, uint8_t value)
+{
+    switch ((addr & 0x3) << 2 | index)
+    {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+    case 0x3:
+        index = value & 0x3;
+        break;
+    case 0x4:
+        command = value;
+        command_timer = CDROM_ACK_DELAY;
+        break;
+    case 0x8:
+        parameters.Push(value);
+        break;
+    case 0x9:
+        interrupt_enable = value & 0x1F;
+        break;
+    case 0xC:
+        if (value & 0x80)
+        {
+            if (data_ready)
+            {
+                bool whole_sector = mode & 0x20;
+                data_index = whole_sector ? 12 : 24;
+                data_size = data_index + (whole_sector ? 0x924 : 0x800);
+                data_ready = false;
+            }
+        }
+        else
+        {
+            data_index = 0;
+            data_size = 0;
+        }
+        break;
+    case 0xD:
+        interrupt_flag &= ~(value & 0x1F);
+        if (value & 0x40)
+            parameters.Clear();
+        break;
+    default:
+        // Audio volume and sound map registers, only relevant once the SPU exists
+        break;
+    }
+}
+
+void CDROM::SaveState(StateWriter &writer)
+{
+    writer.BeginSection("CDRM", 2);
+    writer.Write(GetDiscHash());
+    writer.Write(index);
+    writer.Write(interrupt_enable);
+    writer.Write(interrupt_flag);
+    writer.Write(mode);
+    writer.Write(command);
+    writer.Write(motor);
+    writer.Write(reading);
+    writer.Write(seeking);
+    writer.Write(muted);
+    writer.Write(filter_file);
+    writer.Write(filter_channel);
+    writer.Write(setloc_lba);
+    writer.Write(read_lba);
+    writer.Write(command_timer);
+    writer.Write(second_timer);
+    writer.Write(read_timer);
+    writer.Write(parameters);
+    writer.Write(responses);
+    writer.Write(second_response);
+    writer.Write(sector);
+    writer.Write(data_index);
+    writer.Write(data_size);
+    writer.Write(data_ready);
+    writer.Write(xa_history);
+
+    writer.Write((uint32_t)pending_responses.size());
+    for (auto &response : pending_responses)
+        writer.Write(response);
+    writer.EndSection();
+}
+
+bool CDROM::LoadState(StateReader &reader)
+{
+    uint32_t version;
+    uint32_t pending;
+    uint64_t disc_hash = 0;
+    if (!reader.OpenSection("CDRM", 2, version))
+        return false;
+    if (version >= 2 && !reader.Read(disc_hash))
+        return false;
+
+    // A state taken with an empty drive can be loaded with a disc inserted, like closing the lid afterwards
+    if (disc_hash && disc_hash != GetDiscHash())
+    {
+        if (!this->reader)
+            logger->error("Save state needs the disc it was created with");
+        else
+            logger->error("Save state was created with a different disc");
+        return false;
+    }
+
+    bool success = reader.Read(index) &&
+                   reader.Read(interrupt_enable) &&
+                   reader.Read(interrupt_flag) &&
+                   reader.Read(mode) &&
+                   reader.Read(command) &&
+                   reader.Read(motor) &&
+                   reader.Read(reading) &&
+                   reader.Read(seeking) &&
+                   reader.Read(muted) &&
+                   reader.Read(filter_file) &&
+                   reader.Read(filter_channel) &&
+                   reader.Read(setloc_lba) &&
+                   reader.Read(read_lba) &&
+                   reader.Read(command_timer) &&
+                   reader.Read(second_timer) &&
+                   reader.Read(read_timer) &&
+                   reader.Read(parameters) &&
+                   reader.Read(responses) &&
+                   reader.Read(second_response) &&
+                   reader.Read(sector) &&
+                   reader.Read(data_index) &&
+                   reader.Read(data_size) &&
+                   reader.Read(data_ready) &&
+                   reader.Read(xa_history) &&
+                   reader.Read(pending);
+    if (!success)
+        return false;
+
+    // Everything used as an index later on is checked, a corrupt state must not reach past the buffers
+    bool valid = index <= 3 &&
+                 parameters.Valid() &&
+                 responses.Valid() &&
+                 second_response.size <= second_response.data.size() &&
+                 data_index <= data_size &&
+                 data_size <= SECTOR_SIZE &&
+                 pending <= CDROM_MAX_PENDING;
+    if (!valid)
+    {
+        logger->error("Save state contains invalid CDROM state");
+        return false;
+    }
+
+    pending_responses.resize(pending);
+    for (auto &response : pending_responses)
+    {
+        if (!reader.Read(response))
+            return false;
+        if (response.size > response.data.size())
+        {
+            logger->error("Save state contains invalid CDROM state");
+            return false;
+        }
+    }
+
+    // Older states don't know which disc they were made with, without one there is nothing to read
+    if (!this->reader)
+    {
+        reading = false;
+        seeking = false;
+        read_timer = 0;
+    }
+
+    if (this->reader && reading)
+        this->reader->Prefetch(read_lba);
+    return true;
+}
+
+const std::deque<int16_t> &CDROM::GetAudioBuffer()
+{
+    return xa_buffer;
+}
+
+void CDROM::ClearAudioBuffer()
+{
+    xa_buffer.clear();
+}
+
+// Suppressed sectors are not decoded at all, the ADPCM history is only relevant to frames that get thrown away
+void CDROM::SetAudioSuppressed(bool suppressed)
+{
+    audio_suppressed = suppressed;
+}
+
+void CDROM::ExecuteCommand()
+{
+    std::array<uint8_t, 16> params{};
+    uint8_t param_count = parameters.size;
+    for (int i = 0; i < param_count; i++)
+        params[i] = parameters.Pop();
+
+    psx->Trace(TraceEvent::CDROMCommand, 0x1F801801, command, param_count);
+
+    switch (command)
+    {
+    case 0x01: // GetStat
+        PushResponse(3, {GetStat()});
+        break;
+    case 0x02: // Setloc
+        if (param_count < 3)
+        {
+            ErrorResponse(0x20);
+            break;
+        }
+        setloc_lba = (FromBCD(params[0]) * 60 + FromBCD(params[1])) * SECTORS_PER_SECOND + FromBCD(params[2]) - PREGAP_SECTORS;
+        PushResponse(3, {GetStat()});
+        break;
+    case 0x06: // ReadN
+    case 0x1B: // ReadS
+    {
+        if (!reader)
+        {
+            ErrorResponse(0x80);
+            break;
+        }
+
+        read_lba = setloc_lba;
+        reader->Prefetch(read_lba);
+        motor = true;
+        seeking = true;
+        PushResponse(3, {GetStat()});
+
+        reading = true;
+        int32_t sector_time = CPU_CLOCK / (SECTORS_PER_SECOND * (mode & 0x80 ? 2 : 1));
+        read_timer = CDROM_SEEK_DELAY + sector_time;
+        break;
+    }
+    case 0x08: // Stop
+        reading = false;
+        read_timer = 0;
+        PushResponse(3, {GetStat()});
+        motor = false;
+        ScheduleSecondResponse(2, {GetStat()}, CDROM_SEEK_DELAY);
+        break;
+    case 0x09: // Pause
+        PushResponse(3, {GetStat()});
+        reading = false;
+        read_timer = 0;
+        ScheduleSecondResponse(2, {GetStat()}, CDROM_SEEK_DELAY);
+        break;
+    case 0x0A: // Init
+        mode = 0;
+        motor = true;
+        reading = false;
+        read_timer = 0;
+        PushResponse(3, {GetStat()});
+        ScheduleSecondResponse(2, {GetStat()}, CDROM_INIT_DELAY);
+        break;
+    case 0x0B: // Mute
+        muted = true;
+        PushResponse(3, {GetStat()});
+        break;
+    case 0x0C: // Demute
+        muted = false;
+        PushResponse(3, {GetStat()});
+        break;
+    case 0x0D: // Setfilter
+        filter_file = params[0];
+        filter_channel = params[1];
+        PushResponse(3, {GetStat()});
+        break;
+    case 0x0E: // Setmode
+        mode = params[0];
+        PushResponse(3, {GetStat()});
+        break;
+    case 0x13: // GetTN
+    {
+        if (!reader)
+        {
+            ErrorResponse(0x80);
+            break;
+        }
+        auto &tracks = reader->GetDisc()->GetTracks();
+        PushResponse(3, {GetStat(), ToBCD(tracks.front().number), ToBCD(tracks.back().number)});
+        break;
+    }
+    case 0x14: // GetTD
+    {
+        if (!reader)
+        {
+            ErrorResponse(0x80);
+            break;
+        }
+
+        auto *disc = reader->GetDisc();
+        auto &tracks = disc->GetTracks();
+        uint8_t track = FromBCD(params[0]);
+
+        uint32_t lba;
+        if (track == 0)
+            lba = disc->GetSectorCount();
+        else if (track <= tracks.size())
+            lba = tracks[track - 1].start;
+        else
+        {
+            ErrorResponse(0x10);
+            break;
+        }
+
+        lba += PREGAP_SECTORS;
+        PushResponse(3, {GetStat(), ToBCD(lba / SECTORS_PER_SECOND / 60), ToBCD(lba / SECTORS_PER_SECOND % 60)});
+        break;
+    }
+    case 0x15: // SeekL
+    case 0x16: // SeekP
+        if (!reader)
+        {
+            ErrorResponse(0x80);
+            break;
+        }
+
+        reading = false;
+        read_timer = 0;
+        read_lba = setloc_lba;
+        reader->Prefetch(read_lba);
+        motor = true;
+        seeking = true;
+        PushResponse(3, {GetStat()});
+        seeking = false;
+        ScheduleSecondResponse(2, {GetStat()}, CDROM_SEEK_DELAY);
+        break;
+    case 0x19: // Test
+        if (params[0] == 0x20)
+            PushResponse(3, {0x94, 0x09, 0x19, 0xC0});
+        else
+        {
+            logger->error("Unknown CDROM test command {:02X}", params[0]);
+            ErrorResponse(0x10);
+        }
+        break;
+    case 0x1A: // GetID
+        if (!reader)
+        {
+            PushResponse(3, {GetStat()});
+            ScheduleSecondResponse(5, {0x08, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, CDROM_GETID_DELAY);
+            break;
+        }
+
+        PushResponse(3, {GetStat()});
+        switch (reader->GetDisc()->GetRegion())
+        {
+        case Region::Europe:
+            ScheduleSecondResponse(2, {0x02, 0x00, 0x20, 0x00, 'S', 'C', 'E', 'E'}, CDROM_GETID_DELAY);
+            break;
+        case Region::Japan:
+            ScheduleSecondResponse(2, {0x02, 0x00, 0x20, 0x00, 'S', 'C', 'E', 'I'}, CDROM_GETID_DELAY);
+            break;
+        default:
+            ScheduleSecondResponse(2, {0x02, 0x00, 0x20, 0x00, 'S', 'C', 'E', 'A'}, CDROM_GETID_DELAY);
+            break;
+        }
+        break;
+    case 0x1E: // ReadTOC
+        PushResponse(3, {GetStat()});
+        ScheduleSecondResponse(2, {GetStat()}, CDROM_INIT_DELAY);
+        break;
+    default:
+        logger->error("Unknown CDROM command {:02X}", command);
+        ErrorResponse(0x40);
+        break;
+    }
+}
+
+void CDROM::ReadNextSector()
+{
+    auto result = reader->TryReadSector(read_lba, sector.data());
+
+    // The I/O thread hasn't got the sector yet, the drive just takes a little longer
+    if (result == ReadResult::Pending)
+    {
+        read_timer = CDROM_RETRY_DELAY;
+        return;
+    }
+
+    // Reading past the end or from a broken image stops the drive with a seek error
+    if (result == ReadResult::Failed)
+    {
+        logger->warn("Failed to read sector {}, stopping the read", read_lba);
+        reading = false;
+        seeking = false;
+        read_timer = 0;
+        ErrorResponse(0x04);
+        return;
+    }
+
+    seeking = false;
+    read_lba++;
+    read_timer = CPU_CLOCK / (SECTORS_PER_SECOND * (mode & 0x80 ? 2 : 1));
+
+    uint8_t file = sector[16];
+    uint8_t channel = sector[17];
+    uint8_t submode = sector[18];
+
+    // Real-time XA audio sectors go to the ADPCM decoder instead of the CPU
+    if ((mode & 0x40) && (submode & 0x44) == 0x44)
+    {
+        bool filtered = (mode & 0x08) && (file != filter_file || channel != filter_channel);
+        if (!filtered && !muted && !audio_suppressed)
+            DecodeXA(sector.data());
+        return;
+    }
+
+    data_ready = true;
+
+    // An unacknowledged sector is overrun by the new one
+    std::erase_if(pending_responses, [](const Response &response)
+                  { return response.irq == 1; });
+    PushResponse(1, {GetStat()});
+}
+
+void CDROM::PushResponse(uint8_t irq, std::initializer_list<uint8_t> data)
+{
+    Response response{irq, (uint8_t)data.size(), {}};
+    std::copy(data.begin(), data.end(), response.data.begin());
+    QueueResponse(response);
+}
+
+// The controller only buffers a few interrupts, a guest that never acknowledges them loses the rest
+void CDROM::QueueResponse(const Response &response)
+{
+    if (pending_responses.size() < CDROM_MAX_PENDING)
+        pending_responses.push_back(response);
+}
+
+void CDROM::ScheduleSecondResponse(uint8_t irq, std::initializer_list<uint8_t> data, int32_t delay)
+{
+    second_response = {irq, (uint8_t)data.size(), {}};
+    std::copy(data.begin(), data.end(), second_response.data.begin());
+    second_timer = delay;
+}
+
+void CDROM::DeliverResponses()
+{
+    // The next interrupt is held back until the previous one gets acknowledged
+    if (interrupt_flag & 0x7)
+        return;
+
+    auto response = pending_responses.front();
+    pending_responses.pop_front();
+
+    responses.Clear();
+    for (int i = 0; i < response.size; i++)
+        responses.Push(response.data[i]);
+
+    interrupt_flag = (interrupt_flag & ~0x7) | response.irq;
+    if (interrupt_flag & interrupt_enable)
+        psx->RequestInterrupt(Interrupt::CDROM);
+}
+
+void CDROM::ErrorResponse(uint8_t code)
+{
+    PushResponse(5, {(uint8_t)(GetStat() | 0x1), code});
+}
+
+uint8_t CDROM::GetStat()
+{
+    return motor << 1 | reading << 5 | seeking << 6;
+}
+
+void CDROM::DecodeXA(const uint8_t *sector)
+{
+    static const int32_t positive[] = {0, 60, 115, 98};
+    static const int32_t negative[] = {0, 0, -52, -55};
+
+    uint8_t coding = sector[19];
+    bool stereo = coding & 0x1;
+    bool half_rate = coding & 0x4;
+    bool eight_bit = coding & 0x10;
+    int units = eight_bit ? 4 : 8;
+
+    std::array<std::array<int16_t, 28>, 8> samples;
+    for (int group = 0; group < 18; group++)
+    {
+        const uint8_t *data = sector + 24 + group * 128;
+
+        for (int unit = 0; unit < units; unit++)
+        {
+            uint8_t parameter = data[4 + unit];
+            int shift = parameter & 0xF;
+            if (shift > 12)
+                shift = 9;
+            int filter = parameter >> 4 & 0x3;
+            auto &history = xa_history[stereo ? unit & 1 : 0];
+
+            for (int n = 0; n < 28; n++)
+            {
+                int32_t sample;
+                if (eight_bit)
+                {
+                    sample = (int16_t)(data[16 + n * 4 + unit] << 8) >> shift;
+                }
+                else
+                {
+                    uint8_t byte = data[16 + n * 4 + unit / 2];
+                    uint8_t nibble = unit & 1 ? byte >> 4 : byte & 0xF;
+                    sample = (int16_t)(nibble << 12) >> shift;
+                }
+
+                sample += (history[0] * positive[filter] + history[1] * negative[filter] + 32) / 64;
+                sample = std::clamp(sample, -0x8000, 0x7FFF);
+
+                history[1] = history[0];
+                history[0] = sample;
+                samples[unit][n] = sample;
+            }
+        }
+
+        // Output is interleaved stereo at 37800Hz, half rate streams get every sample doubled
+        int repeat = half_rate ? 2 : 1;
+        for (int unit = 0; unit < units; unit += stereo ? 2 : 1)
+        {
+            for (int n = 0; n < 28; n++)
+            {
+                for (int i = 0; i < repeat; i++)
+                {
+                    xa_buffer.push_back(samples[unit][n]);
+                    xa_buffer.push_back(samples[stereo ? unit + 1 : unit][n]);
+                }
+            }
+        }
+    }
+
+    // Nothing consumes the audio yet, so only the most recent second is kept around
+    while (xa_buffer.size() > XA_BUFFER_LIMIT)
+        xa_buffer.pop_front();
+}
@@ -3,17 +3,100 @@
 
 #include "spdlog/spdlog.h"
 
+#include <utility>
+
 #ifdef WIN32
 #include <intrin.h>
 #endif
 
-CPU::CPU(PSX *psx) : psx(psx)
+const std::array<CPU::RunFunction, CPU_FEATURE_COMBINATIONS> CPU::run_functions = []<size_t... Features>(std::index_sequence<Features...>)
+{
+    return std::array<RunFunction, CPU_FEATURE_COMBINATIONS>{&CPU::RunInstruction<Features>...};
+}(std::make_index_sequence<CPU_FEATURE_COMBINATIONS>());
+
+template void CPU::RunPrimaryInstruction<0>(uint32_t opcode);
+template void CPU::RunSecondaryInstruction<0>(uint32_t opcode);
+
+static uint32_t AccessCycles(MemoryRegion region, uint32_t size)
+{
+    switch (region)
+    {
+    case MemoryRegion::RAM:
+        return RAM_ACCESS_CYCLES;
+    case MemoryRegion::BIOS:
+        return BIOS_BYTE_CYCLES * size;
+    case MemoryRegion::Scratchpad:
+        return 0;
+    default:
+        return MMIO_ACCESS_CYCLES;
+    }
+}
+
+// The multiplier finishes early when the upper bits of the first operand are all equal
+static uint32_t MultiplyCycles(uint32_t value)
+{
+    if (value < 0x800)
+        return 6;
+    else if (value < 0x100000)
+        return 9;
+    return 13;
+}
+
+CPU::CPU(PSX *psx) : psx(psx), logger(psx->GetLogger())
 {
+    icache_tags.fill(ICACHE_INVALID);
+    UpdateFeatures();
 }
 
-void CPU::RunInstruction()
+void CPU::UpdateFeatures()
 {
+    uint8_t features = 0;
+    if (tracing)
+        features |= CPU_FEATURE_TRACE;
+    if (profiler)
+        features |= CPU_FEATURE_PROFILE;
+    if (sr.isolate_cache)
+        features |= CPU_FEATURE_ISOLATE_CACHE;
+    if (!breakpoints.empty())
+        features |= CPU_FEATURE_BREAKPOINTS;
+    run_instruction = run_functions[features];
+}
+
+template <uint8_t Features>
+uint32_t CPU::RunInstruction()
+{
+    current_pc = pc;
+    cycles = 1;
+
+    if constexpr (Features & CPU_FEATURE_BREAKPOINTS)
+    {
+        // The instruction a breakpoint stopped on runs when emulation is resumed
+        if (!resuming && breakpoints.contains(pc))
+        {
+            resuming = true;
+            psx->Stop(StopReason::Breakpoint);
+            return 0;
+        }
+        resuming = false;
+    }
+
+    // Interrupts are held off in branch delay slots, so EPC never has to point at a branch
+    if ((sr.value & 0x401) == 0x401 && next_pc == pc + 4 && psx->InterruptPending())
+    {
+        current_opcode = 0;
+        Exception(ExceptionType::Interrupt);
+        time += cycles;
+        return cycles;
+    }
+
+    if (pc / ICACHE_LINE_SIZE != fetch_line)
+        FetchLine(pc);
+    cycles += fetch_cycles;
+
     uint32_t opcode = psx->ReadMemory32(pc);
+    current_opcode = opcode;
+    if constexpr (Features & CPU_FEATURE_PROFILE)
+        profiler->OnInstruction(current_pc, opcode);
 
     pc = next_pc;
     next_pc += 4;
@@ -24,13 +107,57 @@ void CPU::RunInstruction()
     uint8_t primary_opcode = opcode >> 26;
 
     if (primary_opcode == 0)
-        RunSecondaryInstruction(opcode);
+        RunSecondaryInstruction<Features>(opcode);
     else
-        RunPrimaryInstruction(opcode);
+        RunPrimaryInstruction<Features>(opcode);
 
     regs = out_regs;
+
+    time += cycles;
+    return cycles;
+}
+
+// Only runs when execution enters another line, the cost of every fetch within the line is the same
+void CPU::FetchLine(uint32_t addr)
+{
+    fetch_line = addr / ICACHE_LINE_SIZE;
+
+    uint32_t physical = addr & 0x1FFFFFFF;
+    uint32_t word_cycles = AccessCycles(GetMemoryRegion(physical), 4);
+
+    // KSEG1 bypasses the cache
+    if (addr >= 0xA0000000)
+    {
+        fetch_cycles = word_cycles;
+        return;
+    }
+
+    fetch_cycles = 0;
+    uint32_t &tag = icache_tags[fetch_line % ICACHE_LINES];
+    uint32_t line_tag = physical / (ICACHE_LINES * ICACHE_LINE_SIZE);
+    if (tag != line_tag)
+    {
+        tag = line_tag;
+        cycles += word_cycles * ICACHE_LINE_SIZE / 4;
+    }
 }
 
+// The BIOS flushes the instruction cache by storing to every line while the cache is isolated
+void CPU::InvalidateLine(uint32_t addr)
+{
+    icache_tags[addr / ICACHE_LINE_SIZE % ICACHE_LINES] = ICACHE_INVALID;
+    fetch_line = ICACHE_INVALID;
+}
+
+// HI and LO are only checked when they are read, so a MULT or DIV costs nothing until then
+void CPU::WaitForMultiplier()
+{
+    uint64_t now = time + cycles;
+    if (now < hilo_ready)
+        cycles += hilo_ready - now;
+}
+
+template <uint8_t Features>
 void CPU::RunPrimaryInstruction(uint32_t opcode)
 {
     switch (opcode >> 26)
@@ -42,7 +169,7 @@ void CPU::RunPrimaryInstruction(uint32_t opcode)
         J(opcode);
         break;
     case 0x3:
-        JAL(opcode);
+        JAL<Features>(opcode);
         break;
     case 0x4:
         BEQ(opcode);
@@ -81,31 +208,32 @@ void CPU::RunPrimaryInstruction(uint32_t opcode)
         HandleCoprocessor0(opcode);
         break;
     case 0x20:
-        LB(opcode);
+        LB<Features>(opcode);
         break;
     case 0x23:
-        LW(opcode);
+        LW<Features>(opcode);
         break;
     case 0x24:
-        LBU(opcode);
+        LBU<Features>(opcode);
         break;
     case 0x28:
-        SB(opcode);
+        SB<Features>(opcode);
         break;
     case 0x29:
-        SH(opcode);
+        SH<Features>(opcode);
         break;
     case 0x2B:
-        SW(opcode);
+        SW<Features>(opcode);
         break;
     default:
         Exception(ExceptionType::ReservedInstruction);
-        spdlog::error("Unknown instruction exception: {:08X}", opcode);
-        exit(1);
+        logger->error("Unknown instruction exception: {:08X}", opcode);
+        psx->Stop(StopReason::UnknownInstruction);
         break;
     }
 }
 
+template <uint8_t Features>
 void CPU::RunSecondaryInstruction(uint32_t opcode)
 {
     switch (opcode & 0x3F)
@@ -120,10 +248,10 @@ void CPU::RunSecondaryInstruction(uint32_t opcode)
         SRA(opcode);
         break;
     case 0x8:
-        JR(opcode);
+        JR<Features>(opcode);
         break;
     case 0x9:
-        JALR(opcode);
+        JALR<Features>(opcode);
         break;
     case 0xC:
         SYSCALL(opcode);
@@ -140,6 +268,12 @@ void CPU::RunSecondaryInstruction(uint32_t opcode)
     case 0x13:
         MTLO(opcode);
         break;
+    case 0x18:
+        MULT(opcode);
+        break;
+    case 0x19:
+        MULTU(opcode);
+        break;
     case 0x1A:
         DIV(opcode);
         break;
@@ -169,8 +303,8 @@ void CPU::RunSecondaryInstruction(uint32_t opcode)
         break;
     default:
         Exception(ExceptionType::ReservedInstruction);
-        spdlog::error("Unknown instruction exception: {:08X}", opcode);
-        exit(1);
+        logger->error("Unknown instruction exception: {:08X}", opcode);
+        psx->Stop(StopReason::UnknownInstruction);
         break;
     }
 }
@@ -184,12 +318,109 @@ void CPU::Exception(ExceptionType type)
     sr.value |= (mode << 2) & 0x3F;
 
     cause.excode = type;
+    Increment(psx->GetStats().exceptions[(int)type]);
+    psx->Trace(TraceEvent::Exception, vector, (uint32_t)type);
 
-    epc = next_pc;
+    epc = current_pc;
     pc = vector;
     next_pc = pc + 4;
 }
 
+void CPU::SaveState(StateWriter &writer)
+{
+    writer.BeginSection("CPU ", 2);
+    writer.Write(load_slot);
+    writer.Write(regs);
+    writer.Write(out_regs);
+    writer.Write(sr);
+    writer.Write(cause);
+    writer.Write(epc);
+    writer.Write(current_pc);
+    writer.Write(next_pc);
+    writer.Write(pc);
+    writer.Write(hi);
+    writer.Write(lo);
+    writer.Write(time);
+    writer.Write(hilo_ready);
+    writer.Write(icache_tags);
+    writer.EndSection();
+}
+
+bool CPU::LoadState(StateReader &reader)
+{
+    uint32_t version;
+    bool loaded = reader.OpenSection("CPU ", 2, version) &&
+                  reader.Read(load_slot) &&
+                  reader.Read(regs) &&
+                  reader.Read(out_regs) &&
+                  reader.Read(sr) &&
+                  reader.Read(cause) &&
+                  reader.Read(epc) &&
+                  reader.Read(current_pc) &&
+                  reader.Read(next_pc) &&
+                  reader.Read(pc) &&
+                  reader.Read(hi) &&
+                  reader.Read(lo);
+
+    // Version 1 states predate the timing model and start with a cold cache
+    if (loaded && version >= 2)
+        loaded = reader.Read(time) && reader.Read(hilo_ready) && reader.Read(icache_tags);
+    else if (loaded)
+        icache_tags.fill(ICACHE_INVALID);
+
+    // The pending load is written to a register by the next instruction
+    if (loaded && (load_slot.reg < 0 || load_slot.reg >= 32))
+    {
+        logger->error("Save state contains invalid CPU state");
+        loaded = false;
+    }
+    fetch_line = ICACHE_INVALID;
+    resuming = false;
+
+    // SR decides whether the cache isolated loop is the active one
+    UpdateFeatures();
+    return loaded;
+}
+
+void CPU::SetProfiler(Profiler *profiler)
+{
+    this->profiler = profiler;
+    UpdateFeatures();
+}
+
+void CPU::SetTracing(bool tracing)
+{
+    this->tracing = tracing;
+    UpdateFeatures();
+}
+
+void CPU::AddBreakpoint(uint32_t addr)
+{
+    breakpoints.insert(addr);
+    UpdateFeatures();
+}
+
+void CPU::RemoveBreakpoint(uint32_t addr)
+{
+    breakpoints.erase(addr);
+    UpdateFeatures();
+}
+
+uint32_t CPU::GetPC()
+{
+    return pc;
+}
+
+uint32_t CPU::GetCurrentPC()
+{
+    return current_pc;
+}
+
+uint32_t CPU::GetCurrentOpcode()
+{
+    return current_opcode;
+}
+
 void CPU::SetRegister(int index, uint32_t value)
 {
     if (index == 0)
@@ -204,78 +435,105 @@ uint32_t CPU::GetRegister(int index)
     return regs[index - 1];
 }
 
+template <uint8_t Features>
 void CPU::LB(uint32_t opcode)
 {
-    if (sr.isolate_cache)
+    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
+    if constexpr (Features & CPU_FEATURE_ISOLATE_CACHE)
     {
-        spdlog::debug("Cache Isolate enabled, ignoring read");
+        if constexpr (Features & CPU_FEATURE_TRACE)
+            psx->Trace(TraceEvent::CacheIsolatedLoad, addr, 0, 1);
         return;
     }
+    MemoryRegion region = GetMemoryRegion(addr);
+    Increment(psx->GetStats().reads[(int)region]);
+    cycles += AccessCycles(region, 1);
 
-    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
     load_slot.reg = RT(opcode);
     load_slot.value = (int8_t)psx->ReadMemory8(addr);
 }
 
+template <uint8_t Features>
 void CPU::LBU(uint32_t opcode)
 {
-    if (sr.isolate_cache)
+    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
+    if constexpr (Features & CPU_FEATURE_ISOLATE_CACHE)
     {
-        spdlog::debug("Cache Isolate enabled, ignoring read");
+        if constexpr (Features & CPU_FEATURE_TRACE)
+            psx->Trace(TraceEvent::CacheIsolatedLoad, addr, 0, 1);
         return;
     }
+    MemoryRegion region = GetMemoryRegion(addr);
+    Increment(psx->GetStats().reads[(int)region]);
+    cycles += AccessCycles(region, 1);
 
-    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
     load_slot.reg = RT(opcode);
     load_slot.value = psx->ReadMemory8(addr);
 }
 
+template <uint8_t Features>
 void CPU::LW(uint32_t opcode)
 {
-    if (sr.isolate_cache)
+    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
+    if constexpr (Features & CPU_FEATURE_ISOLATE_CACHE)
     {
-        spdlog::debug("Cache Isolate enabled, ignoring read");
+        if constexpr (Features & CPU_FEATURE_TRACE)
+            psx->Trace(TraceEvent::CacheIsolatedLoad, addr, 0, 4);
         return;
     }
+    MemoryRegion region = GetMemoryRegion(addr);
+    Increment(psx->GetStats().reads[(int)region]);
+    cycles += AccessCycles(region, 4);
 
-    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
     load_slot.reg = RT(opcode);
     load_slot.value = psx->ReadMemory32(addr);
 }
 
+template <uint8_t Features>
 void CPU::SB(uint32_t opcode)
 {
-    if (sr.isolate_cache)
+    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
+    uint32_t value = GetRegister(RT(opcode)) & 0xFF;
+    if constexpr (Features & CPU_FEATURE_ISOLATE_CACHE)
     {
-        spdlog::debug("Cache Isolate enabled, ignoring write");
+        if constexpr (Features & CPU_FEATURE_TRACE)
+            psx->Trace(TraceEvent::CacheIsolatedStore, addr, value, 1);
+        InvalidateLine(addr);
         return;
     }
-    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
-    uint32_t value = GetRegister(RT(opcode)) & 0xFF;
+    Increment(psx->GetStats().writes[(int)GetMemoryRegion(addr)]);
     psx->WriteMemory8(addr, value);
 }
 
+template <uint8_t Features>
 void CPU::SH(uint32_t opcode)
 {
-    if (sr.isolate_cache)
+    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
+    uint32_t value = GetRegister(RT(opcode)) & 0xFFFF;
+    if constexpr (Features & CPU_FEATURE_ISOLATE_CACHE)
     {
-        spdlog::debug("Cache Isolate enabled, ignoring write");
+        if constexpr (Features & CPU_FEATURE_TRACE)
+            psx->Trace(TraceEvent::CacheIsolatedStore, addr, value, 2);
+        InvalidateLine(addr);
         return;
     }
-    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
-    uint32_t value = GetRegister(RT(opcode)) & 0xFFFF;
+    Increment(psx->GetStats().writes[(int)GetMemoryRegion(addr)]);
     psx->WriteMemory16(addr, value);
 }
 
+template <uint8_t Features>
 void CPU::SW(uint32_t opcode)
 {
-    if (sr.isolate_cache)
+    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
+    uint32_t value = GetRegister(RT(opcode));
+    if constexpr (Features & CPU_FEATURE_ISOLATE_CACHE)
     {
-        spdlog::debug("Cache Isolate enabled, ignoring write");
+        if constexpr (Features & CPU_FEATURE_TRACE)
+            psx->Trace(TraceEvent::CacheIsolatedStore, addr, value, 4);
+        InvalidateLine(addr);
         return;
     }
-    uint32_t addr = (int16_t)IMM16(opcode) + GetRegister(RS(opcode));
-    uint32_t value = GetRegister(RT(opcode));
+    Increment(psx->GetStats().writes[(int)GetMemoryRegion(addr)]);
     psx->WriteMemory32(addr, value);
 }
 
@@ -289,7 +547,7 @@ void CPU::ADD(uint32_t opcode)
     if (__builtin_add_overflow(GetRegister(RS(opcode)), IMM16(opcode), &value))
 #endif
     {
-        spdlog::error("ADD overflow");
+        logger->error("ADD overflow");
         Exception(ExceptionType::Overflow);
     }
     SetRegister(RD(opcode), value);
@@ -311,7 +569,7 @@ void CPU::ADDI(uint32_t opcode)
     if (__builtin_add_overflow(GetRegister(RS(opcode)), (int16_t)IMM16(opcode), &value))
 #endif
     {
-        spdlog::error("ADDI overflow");
+        logger->error("ADDI overflow");
         Exception(ExceptionType::Overflow);
     }
     SetRegister(RT(opcode), value);
@@ -401,14 +659,34 @@ void CPU::LUI(uint32_t opcode)
     SetRegister(RT(opcode), value);
 }
 
+void CPU::MULT(uint32_t opcode)
+{
+    auto a = (int32_t)GetRegister(RS(opcode));
+    auto b = (int32_t)GetRegister(RT(opcode));
+    uint64_t result = (int64_t)a * b;
+    hi = result >> 32;
+    lo = result;
+    hilo_ready = time + cycles + MultiplyCycles(a < 0 ? ~a : a);
+}
+
+void CPU::MULTU(uint32_t opcode)
+{
+    uint32_t a = GetRegister(RS(opcode));
+    uint32_t b = GetRegister(RT(opcode));
+    uint64_t result = (uint64_t)a * b;
+    hi = result >> 32;
+    lo = result;
+    hilo_ready = time + cycles + MultiplyCycles(a);
+}
+
 void CPU::DIV(uint32_t opcode)
 {
-    // TODO: Handle timing
+    hilo_ready = time + cycles + DIVIDE_CYCLES;
     auto n = (int32_t)GetRegister(RS(opcode));
     auto d = (int32_t)GetRegister(RT(opcode));
     if (d == 0)
     {
-        hi = d;
+        hi = n;
         if (n >= 0)
             lo = 0xFFFFFFFF;
         else
@@ -428,6 +706,7 @@ void CPU::DIV(uint32_t opcode)
 
 void CPU::DIVU(uint32_t opcode)
 {
+    hilo_ready = time + cycles + DIVIDE_CYCLES;
     uint32_t n = GetRegister(RS(opcode));
     uint32_t d = GetRegister(RT(opcode));
 
@@ -445,13 +724,13 @@ void CPU::DIVU(uint32_t opcode)
 
 void CPU::MFHI(uint32_t opcode)
 {
-    // TODO: Handle stalling
+    WaitForMultiplier();
     SetRegister(RD(opcode), hi);
 }
 
 void CPU::MFLO(uint32_t opcode)
 {
-    // TODO: Handle stalling
+    WaitForMultiplier();
     SetRegister(RD(opcode), lo);
 }
 
@@ -471,21 +750,33 @@ void CPU::J(uint32_t opcode)
     next_pc = addr;
 }
 
+template <uint8_t Features>
 void CPU::JAL(uint32_t opcode)
 {
     SetRegister(31, next_pc);
     uint32_t addr = next_pc & 0xF0000000 | IMM26(opcode) << 2;
+    if constexpr (Features & CPU_FEATURE_PROFILE)
+        profiler->OnCall(addr, next_pc, GetRegister(9));
     next_pc = addr;
 }
 
+template <uint8_t Features>
 void CPU::JR(uint32_t opcode)
 {
+    if constexpr (Features & CPU_FEATURE_PROFILE)
+    {
+        if (RS(opcode) == 31)
+            profiler->OnReturn(GetRegister(31));
+    }
     next_pc = GetRegister(RS(opcode));
 }
 
+template <uint8_t Features>
 void CPU::JALR(uint32_t opcode)
 {
     SetRegister(31, next_pc);
+    if constexpr (Features & CPU_FEATURE_PROFILE)
+        profiler->OnCall(GetRegister(RS(opcode)), next_pc, GetRegister(9));
     next_pc = GetRegister(RS(opcode));
 }
 
@@ -553,16 +844,18 @@ void CPU::MTC0(uint32_t opcode)
     uint32_t value = GetRegister(RT(opcode));
     if (RD(opcode) == 12)
     {
-        if (value != 0x10000 && value != 0x0)
+        if (value & ~0x1043FF3F)
         {
-            spdlog::error("SR unknown value: {:08X}", value);
-            exit(0);
+            logger->error("SR unknown value: {:08X}", value);
+            psx->Stop(StopReason::UnsupportedStatusRegister);
+            return;
         }
         sr.value = value;
+        UpdateFeatures();
     }
     else if (value != 0)
     {
-        spdlog::error("Unhandled COP0 register write to {:08X} with value {:08X}", RD(opcode), value);
+        logger->error("Unhandled COP0 register write to {:08X} with value {:08X}", RD(opcode), value);
     }
 }
 
@@ -575,7 +868,7 @@ void CPU::MFC0(uint32_t opcode)
     }
     else if (RD(opcode) == 13)
     {
-        load_slot.value = cause.value;
+        load_slot.value = cause.value | psx->InterruptPending() << 10;
     }
     else if (RD(opcode) == 14)
     {
@@ -583,16 +876,18 @@ void CPU::MFC0(uint32_t opcode)
     }
     else
     {
-        spdlog::error("Unhandled COP0 register read from {:08X} to {:08X}", RD(opcode), RT(opcode));
-        exit(0);
+        logger->error("Unhandled COP0 register read from {:08X} to {:08X}", RD(opcode), RT(opcode));
+        psx->Stop(StopReason::UnknownCoprocessorRegister);
     }
 }
 
+// Pops the interrupt enable and mode stack, the old pair stays where it was
 void CPU::RFE(uint32_t opcode)
 {
     uint8_t mode = sr.value & 0x3F;
-    sr.value &= !0x3F;
+    sr.value &= ~0xF;
     sr.value |= mode >> 2;
+    UpdateFeatures();
 }
 
 void CPU::HandleCoprocessor0(uint32_t opcode)
@@ -609,7 +904,7 @@ void CPU::HandleCoprocessor0(uint32_t opcode)
         RFE(opcode);
         break;
     default:
-        spdlog::error("Unknown coprocessor instruction exception: {:08X}", opcode);
+        logger->error("Unknown coprocessor instruction exception: {:08X}", opcode);
         break;
     }
 }
\ No newline at end of file
@@ -0,0 +1,570 @@
+#include "disc.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
+#include "spdlog/spdlog.h"
+
+// CHD stores every CD frame with its subchannel data, and pads each track to a multiple of 4 frames
+#define CHD_FRAME_SIZE (SECTOR_SIZE + 96)
+#define CHD_TRACK_PADDING 4
+
+static uint8_t ToBCD(uint8_t value)
+{
+    return (value / 10) << 4 | value % 10;
+}
+
+uint32_t Disc::GetSectorCount()
+{
+    if (tracks.empty())
+        return 0;
+    return tracks.back().start + tracks.back().length;
+}
+
+Region Disc::GetRegion()
+{
+    return region;
+}
+
+uint64_t Disc::GetHash()
+{
+    return hash;
+}
+
+const std::vector<Track> &Disc::GetTracks()
+{
+    return tracks;
+}
+
+void Disc::Identify()
+{
+    // FNV-1a of the user data in the system area, license and volume descriptor. That is
+    // enough to tell discs apart, and is the same for BIN and ISO images of one disc.
+    Sector sector;
+    hash = 0xCBF29CE484222325 ^ GetSectorCount();
+    for (uint32_t lba = 0; lba <= 16 && lba < GetSectorCount(); lba++)
+    {
+        if (!ReadSector(lba, sector.data()))
+            break;
+        for (int i = 24; i < 24 + 0x800; i++)
+            hash = (hash ^ sector[i]) * 0x100000001B3;
+
+        // The license string lives in sector 4 of every PlayStation disc. Region names are split by a
+        // space on real discs, e.g. "Sony Computer Entertainment Euro pe", so only their starts are
+        // matched. Anything unrecognised stays American.
+        if (lba != 4)
+            continue;
+        std::string license(reinterpret_cast<char *>(sector.data() + 24), 0x50);
+        if (license.find("Euro") != std::string::npos)
+            region = Region::Europe;
+        else if (license.find("Amer") != std::string::npos)
+            region = Region::America;
+        else if (license.find("Inc.") != std::string::npos)
+            region = Region::Japan;
+    }
+}
+
+bool BinCueDisc::Open(const std::string &path, spdlog::logger *logger)
+{
+    this->logger = logger;
+    auto extension = std::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    if (extension == ".cue")
+    {
+        if (!OpenCue(path))
+            return false;
+    }
+    else
+    {
+        if (!AddFile(path))
+            return false;
+        tracks.push_back({1, TrackType::Data, 0, files.back()->length});
+    }
+
+    Identify();
+    return true;
+}
+
+bool BinCueDisc::OpenCue(const std::string &path)
+{
+    std::ifstream cue(path);
+    if (cue.fail())
+    {
+        logger->error("Failed to open cue sheet {}", path);
+        return false;
+    }
+
+    auto directory = std::filesystem::path(path).parent_path();
+
+    std::string line;
+    while (std::getline(cue, line))
+    {
+        std::istringstream tokens(line);
+        std::string command;
+        tokens >> command;
+
+        if (command == "FILE")
+        {
+            auto begin = line.find('"');
+            auto end = line.rfind('"');
+            if (begin == std::string::npos || begin == end)
+            {
+                logger->error("Malformed FILE entry in cue sheet: {}", line);
+                return false;
+            }
+
+            auto file = directory / line.substr(begin + 1, end - begin - 1);
+            if (!AddFile(file.string()))
+                return false;
+        }
+        else if (command == "TRACK")
+        {
+            int number;
+            std::string mode;
+            tokens >> number >> mode;
+
+            if (files.empty())
+            {
+                logger->error("TRACK entry before FILE in cue sheet");
+                return false;
+            }
+            if (mode != "AUDIO" && mode != "MODE1/2352" && mode != "MODE2/2352")
+            {
+                logger->error("Unsupported track mode {}", mode);
+                return false;
+            }
+
+            auto type = mode == "AUDIO" ? TrackType::Audio : TrackType::Data;
+            tracks.push_back({(uint8_t)number, type, files.back()->start, 0});
+        }
+        else if (command == "INDEX")
+        {
+            int index;
+            std::string msf;
+            tokens >> index >> msf;
+
+            unsigned int m, s, f;
+            if (tracks.empty() || std::sscanf(msf.c_str(), "%u:%u:%u", &m, &s, &f) != 3)
+            {
+                logger->error("Malformed INDEX entry in cue sheet: {}", line);
+                return false;
+            }
+
+            if (index == 1)
+                tracks.back().start = files.back()->start + (m * 60 + s) * SECTORS_PER_SECOND + f;
+        }
+    }
+
+    if (tracks.empty())
+    {
+        logger->error("Cue sheet {} contains no tracks", path);
+        return false;
+    }
+
+    for (size_t i = 0; i < tracks.size(); i++)
+    {
+        uint32_t end = i + 1 < tracks.size() ? tracks[i + 1].start : files.back()->start + files.back()->length;
+        tracks[i].length = end - tracks[i].start;
+    }
+
+    return true;
+}
+
+bool BinCueDisc::AddFile(const std::string &path)
+{
+    auto file = std::make_unique<File>();
+    file->stream.open(path, std::ios::binary);
+    if (file->stream.fail())
+    {
+        logger->error("Failed to open disc image {}", path);
+        return false;
+    }
+
+    file->stream.seekg(0, std::ios::end);
+    file->length = file->stream.tellg() / SECTOR_SIZE;
+    file->start = files.empty() ? 0 : files.back()->start + files.back()->length;
+
+    files.push_back(std::move(file));
+    return true;
+}
+
+bool BinCueDisc::ReadSector(uint32_t lba, uint8_t *buffer)
+{
+    for (auto &file : files)
+    {
+        if (lba < file->start || lba >= file->start + file->length)
+            continue;
+
+        file->stream.clear();
+        file->stream.seekg((std::streamoff)(lba - file->start) * SECTOR_SIZE);
+        file->stream.read(reinterpret_cast<char *>(buffer), SECTOR_SIZE);
+        return !file->stream.fail();
+    }
+    return false;
+}
+
+bool IsoDisc::Open(const std::string &path, spdlog::logger *logger)
+{
+    this->logger = logger;
+    stream.open(path, std::ios::binary);
+    if (stream.fail())
+    {
+        logger->error("Failed to open disc image {}", path);
+        return false;
+    }
+
+    stream.seekg(0, std::ios::end);
+    uint32_t length = stream.tellg() / 0x800;
+    tracks.push_back({1, TrackType::Data, 0, length});
+
+    Identify();
+    return true;
+}
+
+bool IsoDisc::ReadSector(uint32_t lba, uint8_t *buffer)
+{
+    // ISO images only carry user data, so the rest of a Mode 2 Form 1 sector is synthesised
+    std::memset(buffer, 0, SECTOR_SIZE);
+    std::memset(buffer + 1, 0xFF, 10);
+
+    uint32_t address = lba + PREGAP_SECTORS;
+    buffer[12] = ToBCD(address / SECTORS_PER_SECOND / 60);
+    buffer[13] = ToBCD(address / SECTORS_PER_SECOND % 60);
+    buffer[14] = ToBCD(address % SECTORS_PER_SECOND);
+    buffer[15] = 2;
+    buffer[18] = buffer[22] = 0x08;
+
+    stream.clear();
+    stream.seekg((std::streamoff)lba * 0x800);
+    stream.read(reinterpret_cast<char *>(buffer + 24), 0x800);
+    return !stream.fail();
+}
+
+ChdDisc::~ChdDisc()
+{
+    if (chd)
+        chd_close(chd);
+}
+
+bool ChdDisc::Open(const std::string &path, spdlog::logger *logger)
+{
+    this->logger = logger;
+    chd_error error = chd_open(path.c_str(), CHD_OPEN_READ, nullptr, &chd);
+    if (error != CHDERR_NONE)
+    {
+        logger->error("Failed to open disc image {}: {}", path, chd_error_string(error));
+        chd = nullptr;
+        return false;
+    }
+
+    const chd_header *header = chd_get_header(chd);
+    hunk_count = header->totalhunks;
+    frames_per_hunk = header->hunkbytes / CHD_FRAME_SIZE;
+    if (!frames_per_hunk || header->hunkbytes % CHD_FRAME_SIZE)
+    {
+        logger->error("{} is not a CD image", path);
+        return false;
+    }
+
+    if (!ReadTracks())
+        return false;
+
+    Identify();
+    return true;
+}
+
+bool ChdDisc::ReadTracks()
+{
+    uint32_t lba = 0;
+    uint32_t frame = 0;
+    for (uint32_t index = 0;; index++)
+    {
+        // Older images only have the first version of the track metadata, without gaps
+        char metadata[256]{};
+        int number, frames, pregap = 0, postgap = 0;
+        char type[256]{}, subtype[256]{}, pregap_type[256] = "V", pregap_subtype[256]{};
+        if (chd_get_metadata(chd, CDROM_TRACK_METADATA2_TAG, index, metadata, sizeof(metadata) - 1, nullptr, nullptr, nullptr) == CHDERR_NONE)
+        {
+            if (std::sscanf(metadata, CDROM_TRACK_METADATA2_FORMAT, &number, type, subtype, &frames, &pregap, pregap_type, pregap_subtype, &postgap) != 8)
+            {
+                logger->error("Malformed CHD track metadata: {}", metadata);
+                return false;
+            }
+        }
+        else if (chd_get_metadata(chd, CDROM_TRACK_METADATA_TAG, index, metadata, sizeof(metadata) - 1, nullptr, nullptr, nullptr) == CHDERR_NONE)
+        {
+            if (std::sscanf(metadata, CDROM_TRACK_METADATA_FORMAT, &number, type, subtype, &frames) != 4)
+            {
+                logger->error("Malformed CHD track metadata: {}", metadata);
+                return false;
+            }
+        }
+        else
+            break;
+
+        std::string mode = type;
+        if (mode != "AUDIO" && mode != "MODE1_RAW" && mode != "MODE2_RAW")
+        {
+            logger->error("Unsupported track mode {}", mode);
+            return false;
+        }
+        // A pregap is either part of the track's frames or not stored at all, in which case it reads
+        // as silence. The first track's pregap lies before LBA 0 and is skipped either way.
+        bool stored = pregap_type[0] == 'V';
+        if (frames <= 0 || pregap < 0 || (stored && pregap >= frames))
+        {
+            logger->error("Malformed CHD track metadata: {}", metadata);
+            return false;
+        }
+
+        uint32_t skipped = index == 0 && stored ? pregap : 0;
+        if (index != 0 && !stored)
+            lba += pregap;
+
+        uint32_t start = lba + (stored ? pregap : 0) - skipped;
+        uint32_t length = frames - skipped;
+        extents.push_back({lba, length, frame + skipped, mode == "AUDIO"});
+        tracks.push_back({(uint8_t)number, mode == "AUDIO" ? TrackType::Audio : TrackType::Data, start, 0});
+
+        lba += length;
+        frame += (frames + CHD_TRACK_PADDING - 1) / CHD_TRACK_PADDING * CHD_TRACK_PADDING;
+    }
+
+    if (tracks.empty())
+    {
+        logger->error("CHD image contains no tracks");
+        return false;
+    }
+    auto &last = extents.back();
+    if ((last.frame + last.length - 1) / frames_per_hunk >= hunk_count)
+    {
+        logger->error("CHD image is shorter than its tracks");
+        return false;
+    }
+
+    for (size_t i = 0; i < tracks.size(); i++)
+    {
+        uint32_t end = i + 1 < tracks.size() ? tracks[i + 1].start : lba;
+        tracks[i].length = end - tracks[i].start;
+    }
+    return true;
+}
+
+bool ChdDisc::ReadSector(uint32_t lba, uint8_t *buffer)
+{
+    for (auto &extent : extents)
+    {
+        if (lba < extent.start || lba >= extent.start + extent.length)
+            continue;
+
+        uint32_t frame = extent.frame + lba - extent.start;
+        const uint8_t *hunk = ReadHunk(frame / frames_per_hunk);
+        if (!hunk)
+            return false;
+
+        const uint8_t *data = hunk + frame % frames_per_hunk * CHD_FRAME_SIZE;
+        if (!extent.audio)
+        {
+            std::memcpy(buffer, data, SECTOR_SIZE);
+            return true;
+        }
+
+        // Audio samples are stored big endian
+        for (int i = 0; i < SECTOR_SIZE; i += 2)
+        {
+            buffer[i] = data[i + 1];
+            buffer[i + 1] = data[i];
+        }
+        return true;
+    }
+
+    // Pregaps that aren't stored in the image
+    std::memset(buffer, 0, SECTOR_SIZE);
+    return lba < GetSectorCount();
+}
+
+const uint8_t *ChdDisc::ReadHunk(uint32_t hunk)
+{
+    auto entry = hunks.find(hunk);
+    if (entry != hunks.end())
+    {
+        lru.splice(lru.begin(), lru, entry->second.second);
+        return entry->second.first.data();
+    }
+
+    // The evicted hunk's buffer is reused, decompressing into it is the only work a miss does
+    std::vector<uint8_t> data;
+    if (hunks.size() >= HUNK_CACHE_SIZE)
+    {
+        auto oldest = hunks.find(lru.back());
+        data = std::move(oldest->second.first);
+        hunks.erase(oldest);
+        lru.pop_back();
+    }
+    data.resize(frames_per_hunk * CHD_FRAME_SIZE);
+
+    // A broken hunk is reported by the drive like any other unreadable sector
+    if (chd_read(chd, hunk, data.data()) != CHDERR_NONE)
+        return nullptr;
+
+    lru.push_front(hunk);
+    return hunks.emplace(hunk, std::make_pair(std::move(data), lru.begin())).first->second.first.data();
+}
+
+std::unique_ptr<Disc> OpenDisc(const std::string &path, spdlog::logger *logger)
+{
+    if (!logger)
+        logger = spdlog::default_logger_raw();
+
+    auto extension = std::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    if (extension == ".iso")
+    {
+        auto disc = std::make_unique<IsoDisc>();
+        if (disc->Open(path, logger))
+            return disc;
+    }
+    else if (extension == ".cue" || extension == ".bin" || extension == ".img")
+    {
+        auto disc = std::make_unique<BinCueDisc>();
+        if (disc->Open(path, logger))
+            return disc;
+    }
+    else if (extension == ".chd")
+    {
+        auto disc = std::make_unique<ChdDisc>();
+        if (disc->Open(path, logger))
+            return disc;
+    }
+    else
+    {
+        logger->error("Unsupported disc image format {}", extension);
+    }
+    return nullptr;
+}
+
+DiscReader::DiscReader(std::unique_ptr<Disc> disc) : disc(std::move(disc))
+{
+    thread = std::thread(&DiscReader::Worker, this);
+}
+
+DiscReader::~DiscReader()
+{
+    {
+        std::lock_guard lock(mutex);
+        running = false;
+    }
+    condition.notify_one();
+    thread.join();
+}
+
+Disc *DiscReader::GetDisc()
+{
+    return disc.get();
+}
+
+void DiscReader::Prefetch(uint32_t lba)
+{
+    {
+        std::lock_guard lock(mutex);
+        request_lba = lba;
+        request_generation++;
+    }
+    condition.notify_one();
+}
+
+ReadResult DiscReader::TryReadSector(uint32_t lba, uint8_t *buffer)
+{
+    if (lba >= disc->GetSectorCount())
+        return ReadResult::Failed;
+
+    bool hit;
+    bool refill;
+    {
+        std::lock_guard lock(mutex);
+        auto entry = cache.find(lba);
+        if (entry == cache.end() && read_failed && failed_lba == lba)
+        {
+            read_failed = false;
+            return ReadResult::Failed;
+        }
+
+        hit = entry != cache.end();
+        if (hit)
+        {
+            std::memcpy(buffer, entry->second.first.data(), SECTOR_SIZE);
+            lru.splice(lru.begin(), lru, entry->second.second);
+        }
+
+        uint32_t ahead = lba + READ_AHEAD / 2;
+        refill = !hit || (ahead < disc->GetSectorCount() && !IsCached(ahead));
+        if (refill)
+        {
+            request_lba = hit ? lba + 1 : lba;
+            request_generation++;
+        }
+    }
+
+    if (refill)
+        condition.notify_one();
+    return hit ? ReadResult::Ready : ReadResult::Pending;
+}
+
+void DiscReader::Worker()
+{
+    Sector sector;
+    std::unique_lock lock(mutex);
+    while (running)
+    {
+        condition.wait(lock, [this]
+                       { return !running || handled_generation != request_generation; });
+        if (!running)
+            break;
+
+        handled_generation = request_generation;
+        uint32_t start = request_lba;
+        uint32_t end = std::min(start + READ_AHEAD, disc->GetSectorCount());
+
+        for (uint32_t lba = start; lba < end && running; lba++)
+        {
+            // A newer request restarts the read-ahead window from its own sector
+            if (handled_generation != request_generation)
+                break;
+            if (IsCached(lba))
+                continue;
+
+            lock.unlock();
+            bool success = disc->ReadSector(lba, sector.data());
+            lock.lock();
+
+            // Left for the drive to report, retrying a broken image only repeats the failure
+            if (!success)
+            {
+                read_failed = true;
+                failed_lba = lba;
+                break;
+            }
+            Insert(lba, sector);
+        }
+    }
+}
+
+bool DiscReader::IsCached(uint32_t lba)
+{
+    return cache.find(lba) != cache.end();
+}
+
+void DiscReader::Insert(uint32_t lba, const Sector &sector)
+{
+    if (cache.size() >= CACHE_SIZE)
+    {
+        cache.erase(lru.back());
+        lru.pop_back();
+    }
+    lru.push_front(lba);
+    cache.emplace(lba, std::make_pair(sector, lru.begin()));
+}
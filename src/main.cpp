@@ -1,8 +1,16 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 #include "psx.hpp"
+#include "warmstart.hpp"
+
+#define SHELL_ENTRY 0x80030000
+#define BOOT_TIMEOUT 60
+#define REWIND_CAPACITY (64 << 20)
+#define REWIND_INTERVAL 60
 
 uint8_t *LoadBIOSFile(const char *file_name)
 {
@@ -14,6 +22,10 @@ uint8_t *LoadBIOSFile(const char *file_name)
     auto size = file.tellg();
     file.seekg(0, std::ios::beg);
 
+    // The core reads the whole ROM without checking, anything else is not a BIOS dump
+    if (size != BIOS_SIZE)
+        return nullptr;
+
     auto *buffer = new uint8_t[size];
     file.read(reinterpret_cast<char *>(buffer), size);
 
@@ -24,7 +36,7 @@ int main(int argc, const char *argv[])
 {
     if (argc < 2)
     {
-        std::cerr << "Usage: psx [bios rom]" << std::endl;
+        std::cerr << "Usage: psx [bios rom] [disc image] [--state save state] [--boot-until address --save-state save state] [--boot-cache directory] [--frames count] [--run-ahead frames] [--throttle] [--rewind save state] [--break address] [--stats file] [--trace file] [--profile interval [--symbols file] [--profile-output prefix]]" << std::endl;
         return 1;
     }
 
@@ -36,9 +48,154 @@ int main(int argc, const char *argv[])
     }
 
     PSX psx(bios);
-    psx.Run();
+
+    const char *disc_path = nullptr;
+    const char *state_path = nullptr;
+    const char *warm_path = nullptr;
+    uint32_t boot_until = SHELL_ENTRY;
+    uint64_t frames = 0;
+    int run_ahead = 0;
+    bool throttle = false;
+    int profile_interval = 0;
+    const char *symbols_path = nullptr;
+    const char *trace_path = nullptr;
+    const char *stats_path = nullptr;
+    const char *boot_cache = nullptr;
+    const char *rewind_path = nullptr;
+    std::vector<uint32_t> breakpoints;
+    std::string profile_output = "psx-profile";
+    for (int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--state" && i + 1 < argc)
+            state_path = argv[++i];
+        else if (arg == "--save-state" && i + 1 < argc)
+            warm_path = argv[++i];
+        else if (arg == "--boot-until" && i + 1 < argc)
+            boot_until = std::stoul(argv[++i], nullptr, 16);
+        else if (arg == "--frames" && i + 1 < argc)
+            frames = std::stoull(argv[++i]);
+        else if (arg == "--run-ahead" && i + 1 < argc)
+            run_ahead = std::stoi(argv[++i]);
+        else if (arg == "--throttle")
+            throttle = true;
+        else if (arg == "--rewind" && i + 1 < argc)
+            rewind_path = argv[++i];
+        else if (arg == "--break" && i + 1 < argc)
+            breakpoints.push_back(std::stoul(argv[++i], nullptr, 16));
+        else if (arg == "--boot-cache" && i + 1 < argc)
+            boot_cache = argv[++i];
+        else if (arg == "--stats" && i + 1 < argc)
+            stats_path = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (arg == "--profile" && i + 1 < argc)
+            profile_interval = std::stoi(argv[++i]);
+        else if (arg == "--symbols" && i + 1 < argc)
+            symbols_path = argv[++i];
+        else if (arg == "--profile-output" && i + 1 < argc)
+            profile_output = argv[++i];
+        else
+            disc_path = argv[i];
+    }
+
+    if (disc_path)
+    {
+        auto disc = OpenDisc(disc_path, psx.GetLogger());
+        if (!disc)
+        {
+            std::cerr << "Invalid disc image" << std::endl;
+            delete[] bios;
+            return 1;
+        }
+        psx.InsertDisc(std::move(disc));
+    }
+
+    if (state_path && !psx.LoadStateFromFile(state_path))
+    {
+        std::cerr << "Invalid save state" << std::endl;
+        delete[] bios;
+        return 1;
+    }
+
+    if (stats_path && !psx.PublishStats(stats_path))
+    {
+        delete[] bios;
+        return 1;
+    }
+
+    if (trace_path && !psx.EnableTrace(trace_path))
+    {
+        delete[] bios;
+        return 1;
+    }
+
+    // Boots once and stores the machine so later runs can start from that point with --state
+    if (warm_path)
+    {
+        bool reached = psx.RunUntil(boot_until, (uint64_t)CPU_CLOCK * BOOT_TIMEOUT);
+        if (!reached || !psx.SaveStateToFile(warm_path))
+        {
+            std::cerr << "Failed to create warm start image" << std::endl;
+            delete[] bios;
+            return 1;
+        }
+
+        delete[] bios;
+        return 0;
+    }
+
+    if (boot_cache && !state_path && !BootCached(psx, boot_cache, boot_until, (uint64_t)CPU_CLOCK * BOOT_TIMEOUT))
+    {
+        std::cerr << "Failed to boot through the boot cache" << std::endl;
+        delete[] bios;
+        return 1;
+    }
+
+    Profiler *profiler = nullptr;
+    if (profile_interval > 0)
+    {
+        profiler = psx.EnableProfiler(profile_interval);
+        profiler->LoadBIOSSymbols();
+        if (symbols_path)
+            profiler->LoadSymbols(symbols_path);
+    }
+
+    for (uint32_t addr : breakpoints)
+        psx.AddBreakpoint(addr);
+    psx.EnableRunAhead(run_ahead);
+    psx.SetFastForward(!throttle);
+    if (rewind_path)
+        psx.EnableRewind(REWIND_CAPACITY, REWIND_INTERVAL);
+
+    StopReason reason = psx.Run(0, frames);
+    std::cerr << "Emulation stopped: " << GetStopReasonName(reason) << " after " << psx.GetInstructionCount() << " instructions" << std::endl;
+
+    // Keeps the machine from shortly before a failure, so it can be reproduced with --state
+    if (rewind_path && reason != StopReason::FrameBudget)
+    {
+        if (psx.StepBack() && psx.SaveStateToFile(rewind_path))
+            std::cerr << "Saved the machine from before the stop to " << rewind_path << std::endl;
+        else
+            std::cerr << "No rewind snapshot to save" << std::endl;
+    }
+
+    // Everything above one frame of host time per emulated frame can't keep up in real time
+    auto &stats = psx.GetStats();
+    if (run_ahead && psx.GetFrameCount())
+    {
+        double frame_ms = stats.total_frame_time.load() / 1e6 / psx.GetFrameCount();
+        std::cerr << "Run-ahead of " << run_ahead << " frames took " << frame_ms << " ms per frame, "
+                  << frame_ms / (1000.0 / 60) * 100 << "% of the frame budget" << std::endl;
+    }
+
+    if (profiler)
+    {
+        profiler->WriteFoldedStacks(profile_output + ".folded");
+        profiler->WriteReport(profile_output + ".txt");
+    }
 
     delete[] bios;
 
-    return 0;
+    return reason == StopReason::FrameBudget ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,447 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
+
+#include "spdlog/spdlog.h"
+#include "spdlog/fmt/fmt.h"
+
+#define MAX_STACK_DEPTH 256
+
+#define BIOS_CALL (1ull << 32)
+#define REGION_ROOT (2ull << 32)
+
+static const std::unordered_map<uint32_t, const char *> bios_functions = {
+    {0xA00, "FileOpen"},
+    {0xA01, "FileSeek"},
+    {0xA02, "FileRead"},
+    {0xA03, "FileWrite"},
+    {0xA04, "FileClose"},
+    {0xA05, "FileIoctl"},
+    {0xA06, "exit"},
+    {0xA08, "FileGetc"},
+    {0xA09, "FilePutc"},
+    {0xA0C, "strtoul"},
+    {0xA0D, "strtol"},
+    {0xA10, "atoi"},
+    {0xA11, "atol"},
+    {0xA13, "SaveState"},
+    {0xA14, "RestoreState"},
+    {0xA15, "strcat"},
+    {0xA16, "strncat"},
+    {0xA17, "strcmp"},
+    {0xA18, "strncmp"},
+    {0xA19, "strcpy"},
+    {0xA1A, "strncpy"},
+    {0xA1B, "strlen"},
+    {0xA1E, "strchr"},
+    {0xA1F, "strrchr"},
+    {0xA24, "strstr"},
+    {0xA25, "toupper"},
+    {0xA26, "tolower"},
+    {0xA27, "bcopy"},
+    {0xA28, "bzero"},
+    {0xA29, "bcmp"},
+    {0xA2A, "memcpy"},
+    {0xA2B, "memset"},
+    {0xA2C, "memmove"},
+    {0xA2D, "memcmp"},
+    {0xA2E, "memchr"},
+    {0xA2F, "rand"},
+    {0xA30, "srand"},
+    {0xA31, "qsort"},
+    {0xA33, "malloc"},
+    {0xA34, "free"},
+    {0xA37, "calloc"},
+    {0xA38, "realloc"},
+    {0xA39, "InitHeap"},
+    {0xA3A, "SystemErrorExit"},
+    {0xA3B, "std_in_getchar"},
+    {0xA3C, "std_out_putchar"},
+    {0xA3D, "std_in_gets"},
+    {0xA3E, "std_out_puts"},
+    {0xA3F, "printf"},
+    {0xA40, "SystemErrorUnresolvedException"},
+    {0xA41, "LoadExeHeader"},
+    {0xA42, "LoadExeFile"},
+    {0xA43, "DoExecute"},
+    {0xA44, "FlushCache"},
+    {0xA45, "init_a0_b0_c0_vectors"},
+    {0xA49, "GPU_cw"},
+    {0xA4A, "GPU_cwp"},
+    {0xA4B, "send_gpu_linked_list"},
+    {0xA71, "CdInit"},
+    {0xA72, "CdRemove"},
+    {0xA78, "CdAsyncSeekL"},
+    {0xA7C, "CdAsyncGetStatus"},
+    {0xA7E, "CdAsyncReadSector"},
+    {0xA81, "CdAsyncSetMode"},
+    {0xA96, "AddCDROMDevice"},
+    {0xA97, "AddMemCardDevice"},
+    {0xA99, "AddDummyTtyDevice"},
+    {0xAA2, "EnqueueCdIntr"},
+    {0xAA3, "DequeueCdIntr"},
+    {0xB00, "alloc_kernel_memory"},
+    {0xB01, "free_kernel_memory"},
+    {0xB02, "init_timer"},
+    {0xB03, "get_timer"},
+    {0xB04, "enable_timer_irq"},
+    {0xB05, "disable_timer_irq"},
+    {0xB06, "restart_timer"},
+    {0xB07, "DeliverEvent"},
+    {0xB08, "OpenEvent"},
+    {0xB09, "CloseEvent"},
+    {0xB0A, "WaitEvent"},
+    {0xB0B, "TestEvent"},
+    {0xB0C, "EnableEvent"},
+    {0xB0D, "DisableEvent"},
+    {0xB0E, "OpenThread"},
+    {0xB0F, "CloseThread"},
+    {0xB10, "ChangeThread"},
+    {0xB12, "InitPad"},
+    {0xB13, "StartPad"},
+    {0xB14, "StopPad"},
+    {0xB17, "ReturnFromException"},
+    {0xB18, "SetDefaultExitFromException"},
+    {0xB19, "SetCustomExitFromException"},
+    {0xB20, "UnDeliverEvent"},
+    {0xB32, "FileOpen"},
+    {0xB33, "FileSeek"},
+    {0xB34, "FileRead"},
+    {0xB35, "FileWrite"},
+    {0xB36, "FileClose"},
+    {0xB37, "FileIoctl"},
+    {0xB38, "exit"},
+    {0xB3C, "std_in_getchar"},
+    {0xB3D, "std_out_putchar"},
+    {0xB3E, "std_in_gets"},
+    {0xB3F, "std_out_puts"},
+    {0xB40, "chdir"},
+    {0xB42, "firstfile"},
+    {0xB43, "nextfile"},
+    {0xB47, "AddDevice"},
+    {0xB48, "RemoveDevice"},
+    {0xB4A, "InitCard"},
+    {0xB4B, "StartCard"},
+    {0xB4C, "StopCard"},
+    {0xB4E, "write_card_sector"},
+    {0xB4F, "read_card_sector"},
+    {0xB50, "allow_new_card"},
+    {0xB54, "GetLastError"},
+    {0xB55, "GetLastFileError"},
+    {0xB56, "GetC0Table"},
+    {0xB57, "GetB0Table"},
+    {0xB5B, "ChangeClearPad"},
+    {0xC00, "EnqueueTimerAndVblankIrqs"},
+    {0xC01, "EnqueueSyscallHandler"},
+    {0xC02, "SysEnqIntRP"},
+    {0xC03, "SysDeqIntRP"},
+    {0xC04, "get_free_EvCB_slot"},
+    {0xC05, "get_free_TCB_slot"},
+    {0xC06, "ExceptionHandler"},
+    {0xC07, "InstallExceptionHandlers"},
+    {0xC08, "SysInitMemory"},
+    {0xC09, "SysInitKernelVariables"},
+    {0xC0A, "ChangeClearRCnt"},
+    {0xC0C, "InitDefInt"},
+    {0xC0D, "SetIrqAutoAck"},
+    {0xC12, "InstallDevices"},
+    {0xC13, "FlushStdInOutPut"},
+    {0xC1B, "KernelRedirect"},
+    {0xC1C, "AdjustA0Table"},
+};
+
+static const char *primary_names[64] = {
+    "SPECIAL", "BcondZ", "J", "JAL", "BEQ", "BNE", "BLEZ", "BGTZ",
+    "ADDI", "ADDIU", "SLTI", "SLTIU", "ANDI", "ORI", "XORI", "LUI",
+    "COP0", "COP1", "COP2", "COP3", nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+    "LB", "LH", "LWL", "LW", "LBU", "LHU", "LWR", nullptr,
+    "SB", "SH", "SWL", "SW", nullptr, nullptr, "SWR", nullptr,
+    "LWC0", "LWC1", "LWC2", "LWC3", nullptr, nullptr, nullptr, nullptr,
+    "SWC0", "SWC1", "SWC2", "SWC3", nullptr, nullptr, nullptr, nullptr};
+
+static const char *secondary_names[64] = {
+    "SLL", nullptr, "SRL", "SRA", "SLLV", nullptr, "SRLV", "SRAV",
+    "JR", "JALR", nullptr, nullptr, "SYSCALL", "BREAK", nullptr, nullptr,
+    "MFHI", "MTHI", "MFLO", "MTLO", nullptr, nullptr, nullptr, nullptr,
+    "MULT", "MULTU", "DIV", "DIVU", nullptr, nullptr, nullptr, nullptr,
+    "ADD", "ADDU", "SUB", "SUBU", "AND", "OR", "XOR", "NOR",
+    nullptr, nullptr, "SLT", "SLTU", nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+Profiler::Profiler(int interval, spdlog::logger *logger) : logger(logger), interval(interval), countdown(interval)
+{
+}
+
+bool Profiler::LoadSymbols(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (file.fail())
+    {
+        logger->error("Failed to open symbol file {}", path);
+        return false;
+    }
+
+    std::vector<uint8_t> data(std::istreambuf_iterator<char>(file), {});
+    if (data.size() >= 4 && std::memcmp(data.data(), "\x7F" "ELF", 4) == 0)
+        return LoadELFSymbols(data);
+
+    // Map files come in many flavours, every line starting with an address and ending with a name is taken
+    std::istringstream map(std::string(data.begin(), data.end()));
+    std::string line;
+    size_t loaded = 0;
+    while (std::getline(map, line))
+    {
+        std::istringstream tokens(line);
+        std::string address;
+        std::string name;
+        if (!(tokens >> address))
+            continue;
+        while (tokens >> name)
+            ;
+        if (name.empty())
+            continue;
+
+        char *end;
+        uint32_t value = std::strtoul(address.c_str(), &end, 16);
+        if (*end != '\0' || value == 0)
+            continue;
+
+        symbols[value & 0x1FFFFFFF] = name;
+        loaded++;
+    }
+
+    logger->info("Loaded {} symbols from {}", loaded, path);
+    return loaded != 0;
+}
+
+bool Profiler::LoadELFSymbols(const std::vector<uint8_t> &elf)
+{
+    auto read16 = [&](size_t offset)
+    {
+        uint16_t value = 0;
+        if (offset + 2 <= elf.size())
+            std::memcpy(&value, elf.data() + offset, 2);
+        return value;
+    };
+    auto read32 = [&](size_t offset)
+    {
+        uint32_t value = 0;
+        if (offset + 4 <= elf.size())
+            std::memcpy(&value, elf.data() + offset, 4);
+        return value;
+    };
+
+    // Only little endian ELF32, which is all a MIPS R3000A toolchain produces
+    if (elf.size() < 0x34 || elf[4] != 1 || elf[5] != 1)
+    {
+        logger->error("Unsupported ELF file");
+        return false;
+    }
+
+    uint32_t section_offset = read32(0x20);
+    uint16_t section_size = read16(0x2E);
+    uint16_t section_count = read16(0x30);
+
+    size_t loaded = 0;
+    for (int i = 0; i < section_count; i++)
+    {
+        size_t header = section_offset + i * section_size;
+        if (read32(header + 0x04) != 2)
+            continue;
+
+        uint32_t offset = read32(header + 0x10);
+        uint32_t size = read32(header + 0x14);
+        size_t strings = read32(section_offset + read32(header + 0x18) * section_size + 0x10);
+
+        for (uint32_t symbol = offset; symbol + 16 <= offset + size && symbol + 16 <= elf.size(); symbol += 16)
+        {
+            uint32_t name = read32(symbol);
+            uint32_t value = read32(symbol + 4);
+            uint8_t info = elf[symbol + 12];
+            if ((info & 0xF) != 2 || strings + name >= elf.size())
+                continue;
+
+            const char *start = reinterpret_cast<const char *>(elf.data() + strings + name);
+            symbols[value & 0x1FFFFFFF] = std::string(start, strnlen(start, elf.size() - strings - name));
+            loaded++;
+        }
+    }
+
+    logger->info("Loaded {} ELF symbols", loaded);
+    return loaded != 0;
+}
+
+void Profiler::LoadBIOSSymbols()
+{
+    for (auto &[function, name] : bios_functions)
+        bios_symbols[function] = name;
+}
+
+void Profiler::OnCall(uint32_t target, uint32_t return_addr, uint32_t function)
+{
+    if (stack.size() >= MAX_STACK_DEPTH)
+        return;
+
+    // Calls through the BIOS tables at A0h/B0h/C0h are told apart by the function number in $t1
+    uint32_t address = target & 0x1FFFFFFF;
+    if (address == 0xA0 || address == 0xB0 || address == 0xC0)
+        stack.push_back({BIOS_CALL | address << 4 | (function & 0xFF), return_addr});
+    else
+        stack.push_back({address, return_addr});
+}
+
+void Profiler::OnReturn(uint32_t target)
+{
+    // Returns which don't match any frame (longjmp, task switches) leave the stack alone
+    for (size_t i = stack.size(); i > 0; i--)
+    {
+        if (stack[i - 1].return_addr == target)
+        {
+            stack.resize(i - 1);
+            return;
+        }
+    }
+}
+
+void Profiler::Sample(uint32_t pc)
+{
+    std::vector<uint64_t> key;
+    key.reserve(stack.size() + 2);
+
+    uint32_t address = pc & 0x1FFFFFFF;
+    key.push_back(REGION_ROOT | (address >= 0x1FC00000 ? 1 : address < 0x800000 ? 0 : 2));
+
+    for (auto &frame : stack)
+        key.push_back(frame.function);
+
+    uint64_t leaf = FindFunction(pc);
+    if (leaf && (stack.empty() || stack.back().function != leaf))
+        key.push_back(leaf);
+
+    samples[key]++;
+}
+
+uint64_t Profiler::FindFunction(uint32_t pc)
+{
+    auto symbol = symbols.upper_bound(pc & 0x1FFFFFFF);
+    if (symbol == symbols.begin())
+        return 0;
+    return std::prev(symbol)->first;
+}
+
+std::string Profiler::GetName(uint64_t function)
+{
+    if (function & REGION_ROOT)
+    {
+        static const char *regions[] = {"ram", "bios", "io"};
+        return regions[function & 0x3];
+    }
+
+    if (function & BIOS_CALL)
+    {
+        uint32_t index = function & 0xFFF;
+        auto name = bios_symbols.find(index);
+        if (name != bios_symbols.end())
+            return name->second;
+        return fmt::format("{:X}({:02X}h)", index >> 8, index & 0xFF);
+    }
+
+    auto symbol = symbols.find(function);
+    if (symbol != symbols.end())
+        return symbol->second;
+
+    uint32_t address = function;
+    return fmt::format("func_{:08X}", address | (address >= 0x1FC00000 ? 0xA0000000 : 0x80000000));
+}
+
+bool Profiler::WriteFoldedStacks(const std::string &path)
+{
+    std::ofstream file(path);
+    if (file.fail())
+    {
+        logger->error("Failed to open {}", path);
+        return false;
+    }
+
+    for (auto &[key, count] : samples)
+    {
+        for (size_t i = 0; i < key.size(); i++)
+            file << (i ? ";" : "") << GetName(key[i]);
+        file << " " << count << "\n";
+    }
+    return !file.fail();
+}
+
+bool Profiler::WriteReport(const std::string &path)
+{
+    std::ofstream file(path);
+    if (file.fail())
+    {
+        logger->error("Failed to open {}", path);
+        return false;
+    }
+
+    std::unordered_map<uint64_t, std::pair<uint64_t, uint64_t>> functions;
+    uint64_t total = 0;
+    for (auto &[key, count] : samples)
+    {
+        total += count;
+        functions[key.back()].first += count;
+
+        // Recursion shouldn't count a sample more than once towards the inclusive total
+        std::vector<uint64_t> seen;
+        for (auto function : key)
+        {
+            if (std::find(seen.begin(), seen.end(), function) != seen.end())
+                continue;
+            seen.push_back(function);
+            functions[function].second += count;
+        }
+    }
+
+    std::vector<std::pair<uint64_t, std::pair<uint64_t, uint64_t>>> sorted(functions.begin(), functions.end());
+    std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b)
+              { return a.second.first > b.second.first; });
+
+    file << fmt::format("{} samples every {} instructions\n\n", total, interval);
+    file << fmt::format("{:>10} {:>7} {:>10} {:>7}  {}\n", "self", "%", "total", "%", "function");
+    for (auto &[function, counts] : sorted)
+    {
+        file << fmt::format("{:>10} {:>6.2f}% {:>10} {:>6.2f}%  {}\n",
+                            counts.first, 100.0 * counts.first / total,
+                            counts.second, 100.0 * counts.second / total,
+                            GetName(function));
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> opcodes;
+    for (int i = 1; i < 64; i++)
+    {
+        if (primary_counts[i])
+            opcodes.push_back({primary_names[i] ? primary_names[i] : fmt::format("primary_{:02X}", i), primary_counts[i]});
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        if (secondary_counts[i])
+            opcodes.push_back({secondary_names[i] ? secondary_names[i] : fmt::format("secondary_{:02X}", i), secondary_counts[i]});
+    }
+    std::sort(opcodes.begin(), opcodes.end(), [](auto &a, auto &b)
+              { return a.second > b.second; });
+
+    uint64_t executed = 0;
+    for (auto &[name, count] : opcodes)
+        executed += count;
+
+    file << fmt::format("\n{} instructions executed\n\n", executed);
+    file << fmt::format("{:>12} {:>7}  {}\n", "count", "%", "opcode");
+    for (auto &[name, count] : opcodes)
+        file << fmt::format("{:>12} {:>6.2f}%  {}\n", count, 100.0 * count / executed, name);
+
+    return !file.fail();
+}
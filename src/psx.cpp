@@ -1,46 +1,583 @@
 #include "psx.hpp"
 
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "spdlog/spdlog.h"
 
-PSX::PSX(uint8_t *bios) : bios(bios)
+static uint64_t HashBIOS(const uint8_t *bios)
+{
+    // FNV-1a, only used to refuse states made with a different BIOS
+    uint64_t hash = 0xCBF29CE484222325;
+    for (int i = 0; i < BIOS_SIZE; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bios + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3;
+    }
+    return hash;
+}
+
+const char *GetStopReasonName(StopReason reason)
+{
+    switch (reason)
+    {
+    case StopReason::None:
+        return "None";
+    case StopReason::UnknownMemoryRead:
+        return "UnknownMemoryRead";
+    case StopReason::UnknownMemoryWrite:
+        return "UnknownMemoryWrite";
+    case StopReason::UnknownInstruction:
+        return "UnknownInstruction";
+    case StopReason::UnknownCoprocessorRegister:
+        return "UnknownCoprocessorRegister";
+    case StopReason::UnsupportedStatusRegister:
+        return "UnsupportedStatusRegister";
+    case StopReason::InstructionBudget:
+        return "InstructionBudget";
+    case StopReason::FrameBudget:
+        return "FrameBudget";
+    case StopReason::Breakpoint:
+        return "Breakpoint";
+    }
+    return "Unknown";
+}
+
+PSX::PSX(uint8_t *bios, std::shared_ptr<spdlog::logger> logger) : logger(logger ? logger : spdlog::default_logger()), bios(bios), bios_hash(HashBIOS(bios))
 {
     cpu = new CPU(this);
-    ram = new uint8_t[0x200000];
+    cdrom = new CDROM(this);
+    cdrom->SetAudioSuppressed(fast_forward);
+#ifdef __linux__
+    // Anonymous mappings come zeroed for free and can be swapped for a copy-on-write image
+    void *mapping = mmap(nullptr, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED)
+    {
+        ram = (uint8_t *)mapping;
+        ram_mapped = true;
+        return;
+    }
+    this->logger->warn("Failed to map RAM, warm images will be copied instead of shared");
+#endif
+    ram = new uint8_t[RAM_SIZE]();
 }
 
 PSX::~PSX()
 {
+    rewind.reset();
+#ifdef __linux__
+    if (stats != &local_stats)
+        munmap(stats, sizeof(Stats));
+#endif
+    if (trace && trace->GetDropped())
+        logger->warn("Trace buffer overflowed, {} events were dropped", trace->GetDropped());
+    trace.reset();
     delete cpu;
+    delete cdrom;
+#ifdef __linux__
+    if (ram_mapped)
+    {
+        munmap(ram, RAM_SIZE);
+        return;
+    }
+#endif
     delete[] ram;
 }
 
-void PSX::Run()
+StopReason PSX::Run(uint64_t max_instructions, uint64_t max_frames)
+{
+    stop_reason = StopReason::None;
+    instruction_limit = max_instructions ? instructions + max_instructions : 0;
+    uint64_t frame_limit = max_frames ? frames + max_frames : 0;
+
+    while (stop_reason == StopReason::None)
+    {
+        if (frame_limit && frames == frame_limit)
+        {
+            Stop(StopReason::FrameBudget);
+            break;
+        }
+        RunFrame();
+    }
+
+    instruction_limit = 0;
+    UpdateStats();
+    return stop_reason;
+}
+
+void PSX::RunFrame()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (run_ahead_frames)
+        RunAheadFrame();
+    else
+        EmulateFrame();
+
+    if (stop_reason != StopReason::None)
+        return;
+
+    uint64_t frame_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    stats->frame_time.store(frame_time, std::memory_order_relaxed);
+    stats->total_frame_time.store(stats->total_frame_time.load(std::memory_order_relaxed) + frame_time, std::memory_order_relaxed);
+    UpdateStats();
+
+    if (!fast_forward)
+        Throttle();
+}
+
+// Sleeps until the frame is due. A host that fell behind starts over from now instead of
+// catching up with a burst of frames.
+void PSX::Throttle()
+{
+    auto now = std::chrono::steady_clock::now();
+    frame_deadline += FRAME_DURATION;
+    if (frame_deadline < now)
+        frame_deadline = now;
+    else
+        std::this_thread::sleep_until(frame_deadline);
+}
+
+// A frame cut short by an error, budget or breakpoint is picked up where it stopped by the next
+// Run, so frames always end at the same point no matter how the run was split up
+void PSX::EmulateFrame()
+{
+    while (frame_cycles < CYCLES_PER_FRAME && stop_reason == StopReason::None)
+    {
+        // Nothing ran when a breakpoint stopped the CPU
+        uint32_t elapsed = cpu->RunInstruction();
+        if (!elapsed)
+            break;
+        cdrom->Step(elapsed);
+        frame_cycles += elapsed;
+
+        if (++instructions == instruction_limit)
+            Stop(StopReason::InstructionBudget);
+    }
+
+    if (stop_reason != StopReason::None)
+        return;
+
+    frame_cycles = 0;
+    frames++;
+    if (rewind && !speculating)
+        rewind->OnFrame();
+}
+
+// Runs the real frame, then the speculative ones from a snapshot, and returns to the snapshot.
+// The last speculative frame is the one presented. Only the RAM pages the speculation wrote to
+// are copied back, and the dirty pages are left as the real frame left them.
+void PSX::RunAheadFrame()
+{
+    EmulateFrame();
+    if (stop_reason != StopReason::None)
+        return;
+
+    run_ahead_state.Reset();
+    SaveState(run_ahead_state, false);
+    std::memcpy(run_ahead_ram.data(), ram, RAM_SIZE);
+    auto real_dirty_pages = dirty_pages;
+    dirty_pages.reset();
+
+    uint64_t real_instructions = instructions;
+    uint64_t real_frames = frames;
+    uint64_t real_instruction_limit = instruction_limit;
+    instruction_limit = 0;
+    speculating = true;
+    cdrom->SetAudioSuppressed(true);
+
+    // Speculative frames are thrown away, so they don't count, trace or profile anything
+    Stats *real_stats = stats;
+    stats = &speculative_stats;
+    cpu->SetTracing(false);
+    cpu->SetProfiler(nullptr);
+
+    for (int i = 0; i < run_ahead_frames && stop_reason == StopReason::None; i++)
+        EmulateFrame();
+
+    // Whatever stopped the speculation will stop the real timeline again when it gets there
+    stop_reason = StopReason::None;
+    cpu->SetProfiler(profiler.get());
+    cpu->SetTracing(trace != nullptr);
+    stats = real_stats;
+    cdrom->SetAudioSuppressed(fast_forward);
+    speculating = false;
+    instruction_limit = real_instruction_limit;
+    frames = real_frames;
+    instructions = real_instructions;
+
+    for (size_t page = 0; page < RAM_PAGES; page++)
+        if (dirty_pages[page])
+            std::memcpy(ram + page * RAM_PAGE_SIZE, run_ahead_ram.data() + page * RAM_PAGE_SIZE, RAM_PAGE_SIZE);
+    dirty_pages = real_dirty_pages;
+
+    // The snapshot was just taken from this machine, it can't fail halfway
+    StateReader reader(run_ahead_state.GetData(), run_ahead_state.GetSize(), logger.get());
+    ReadState(reader, false);
+}
+
+bool PSX::RunUntil(uint32_t addr, uint64_t max_cycles)
 {
-    while (true)
+    stop_reason = StopReason::None;
+    for (uint64_t cycles = 0; cycles < max_cycles && stop_reason == StopReason::None;)
     {
-        cpu->RunInstruction();
+        if (cpu->GetPC() == addr)
+            return true;
+
+        uint32_t elapsed = cpu->RunInstruction();
+        if (!elapsed)
+            break;
+        cdrom->Step(elapsed);
+        cycles += elapsed;
+        instructions++;
     }
+    return false;
+}
+
+void PSX::Stop(StopReason reason)
+{
+    // The first reason wins, later ones are usually fallout from it
+    if (stop_reason == StopReason::None)
+        stop_reason = reason;
+}
+
+StopReason PSX::GetStopReason()
+{
+    return stop_reason;
+}
+
+uint64_t PSX::GetInstructionCount()
+{
+    return instructions;
+}
+
+uint64_t PSX::GetFrameCount()
+{
+    return frames;
+}
+
+spdlog::logger *PSX::GetLogger()
+{
+    return logger.get();
+}
+
+void PSX::InsertDisc(std::unique_ptr<Disc> disc)
+{
+    cdrom->InsertDisc(std::move(disc));
+}
+
+bool PSX::HasDisc()
+{
+    return cdrom->HasDisc();
+}
+
+uint64_t PSX::GetDiscHash()
+{
+    return cdrom->GetDiscHash();
+}
+
+uint64_t PSX::GetBIOSHash()
+{
+    return bios_hash;
+}
+
+void PSX::SaveState(StateWriter &writer, bool include_ram)
+{
+    writer.BeginSection("PSX ", 3);
+    writer.Write(bios_hash);
+    writer.Write(i_stat);
+    writer.Write(i_mask);
+    writer.Write(scratchpad);
+    writer.Write(frame_cycles);
+    writer.EndSection();
+
+    if (include_ram)
+    {
+        writer.BeginSection("RAM ", 1);
+        writer.WriteBytes(ram, RAM_SIZE);
+        writer.EndSection();
+    }
+
+    cpu->SaveState(writer);
+    cdrom->SaveState(writer);
+}
+
+// Sections are loaded straight into the devices, so a state that turns out to be broken
+// halfway through is rolled back to the machine as it was before
+bool PSX::LoadState(StateReader &reader, bool include_ram)
+{
+    load_backup.Reset();
+    SaveState(load_backup, include_ram);
+    auto previous_dirty_pages = dirty_pages;
+
+    // Audio queued before the load belongs to a timeline that is gone. Run-ahead restores through
+    // ReadState directly and keeps it, the real frame's audio is still waiting to be played.
+    if (ReadState(reader, include_ram))
+    {
+        cdrom->ClearAudioBuffer();
+        return true;
+    }
+
+    StateReader backup(load_backup.GetData(), load_backup.GetSize(), logger.get());
+    ReadState(backup, include_ram);
+    dirty_pages = previous_dirty_pages;
+    return false;
+}
+
+bool PSX::ReadState(StateReader &reader, bool include_ram)
+{
+    if (!reader.IsValid())
+        return false;
+
+    uint32_t version;
+    uint64_t hash;
+    if (!reader.OpenSection("PSX ", 3, version) || !reader.Read(hash))
+        return false;
+    if (hash != bios_hash)
+    {
+        logger->error("Save state was created with a different BIOS");
+        return false;
+    }
+
+    if (!reader.Read(i_stat) || !reader.Read(i_mask))
+        return false;
+    if (version < 2)
+        scratchpad.fill(0);
+    else if (!reader.Read(scratchpad))
+        return false;
+
+    // Older states were only taken at frame boundaries
+    if (version < 3)
+        frame_cycles = 0;
+    else if (!reader.Read(frame_cycles))
+        return false;
+
+    if (include_ram)
+    {
+        if (!reader.OpenSection("RAM ", 1, version) || !reader.ReadBytes(ram, RAM_SIZE))
+            return false;
+        dirty_pages.set();
+    }
+
+    return cpu->LoadState(reader) && cdrom->LoadState(reader);
+}
+
+bool PSX::SaveStateToFile(const std::string &path)
+{
+    StateWriter writer;
+    SaveState(writer);
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(writer.GetData()), writer.GetSize());
+    if (file.fail())
+    {
+        logger->error("Failed to write save state {}", path);
+        return false;
+    }
+    return true;
+}
+
+bool PSX::LoadStateFromFile(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (file.fail())
+    {
+        logger->error("Failed to open save state {}", path);
+        return false;
+    }
+
+    std::vector<uint8_t> data(std::istreambuf_iterator<char>(file), {});
+    StateReader reader(data.data(), data.size(), logger.get());
+    return LoadState(reader);
+}
+
+void PSX::EnableRewind(size_t capacity, int interval)
+{
+    rewind = std::make_unique<RewindBuffer>(this, capacity, interval);
+}
+
+bool PSX::StepBack()
+{
+    if (!rewind)
+        return false;
+    return rewind->StepBack();
+}
+
+void PSX::EnableRunAhead(int frames)
+{
+    run_ahead_frames = frames;
+    run_ahead_ram.resize(frames ? RAM_SIZE : 0);
+}
+
+// Fast forward runs as fast as the host allows and drops XA audio, which nothing consumes
+// at that speed. Otherwise frames are paced to 60 Hz and audio is decoded.
+void PSX::SetFastForward(bool enabled)
+{
+    fast_forward = enabled;
+    frame_deadline = std::chrono::steady_clock::now();
+    cdrom->SetAudioSuppressed(enabled);
+}
+
+Profiler *PSX::EnableProfiler(int interval)
+{
+    profiler = std::make_unique<Profiler>(interval, logger.get());
+    cpu->SetProfiler(profiler.get());
+    return profiler.get();
+}
+
+bool PSX::PublishStats(const std::string &path)
+{
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(Stats)) == -1)
+    {
+        logger->error("Failed to create stats file {}", path);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(nullptr, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        logger->error("Failed to map stats file {}", path);
+        return false;
+    }
+
+    if (stats != &local_stats)
+        munmap(stats, sizeof(Stats));
+
+    // Counters start over in the file, viewers only look at rates and totals since publishing
+    stats = new (mapping) Stats();
+    stats->pid = getpid();
+    const std::string &name = logger->name().empty() ? path : logger->name();
+    name.copy(stats->name, STATS_NAME_SIZE - 1);
+    UpdateStats();
+    return true;
+#else
+    logger->error("Publishing stats is only supported on Linux");
+    return false;
+#endif
+}
+
+void PSX::UpdateStats()
+{
+    stats->instructions.store(instructions, std::memory_order_relaxed);
+    stats->frames.store(frames, std::memory_order_relaxed);
+    stats->stop_reason.store((uint32_t)stop_reason, std::memory_order_relaxed);
+    stats->updated.store(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+}
+
+void PSX::AddBreakpoint(uint32_t addr)
+{
+    cpu->AddBreakpoint(addr);
+}
+
+void PSX::RemoveBreakpoint(uint32_t addr)
+{
+    cpu->RemoveBreakpoint(addr);
+}
+
+bool PSX::EnableTrace(const std::string &path)
+{
+    trace = std::make_unique<TraceBuffer>(path);
+    if (!trace->IsOpen())
+    {
+        logger->error("Failed to open trace file {}", path);
+        trace.reset();
+        return false;
+    }
+    cpu->SetTracing(true);
+    return true;
+}
+
+// Every write is traced, but only the first one per register reaches the text log
+void PSX::UnimplementedWrite(const char *name, uint32_t addr, uint32_t value, uint16_t size)
+{
+    Trace(TraceEvent::UnimplementedWrite, addr, value, size);
+    Increment(stats->unimplemented_registers);
+    if (!speculating && reported_registers.insert(addr).second)
+        logger->warn("Unimplemented {} Register: {:08X}, further writes are only traced", name, addr);
+}
+
+uint8_t *PSX::GetRAM()
+{
+    return ram;
+}
+
+bool PSX::MapRAM(int fd)
+{
+#ifdef __linux__
+    // Replaces the RAM in place with a private mapping, pages get copied on first write
+    if (!ram_mapped)
+        return false;
+    void *mapping = mmap(ram, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    dirty_pages.set();
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::bitset<RAM_PAGES> &PSX::GetDirtyPages()
+{
+    return dirty_pages;
+}
+
+void PSX::RequestInterrupt(Interrupt interrupt)
+{
+    Trace(TraceEvent::Interrupt, 0, (uint32_t)interrupt);
+    i_stat |= 1 << (int)interrupt;
+}
+
+bool PSX::InterruptPending()
+{
+    return i_stat & i_mask;
 }
 
 uint8_t PSX::ReadMemory8(uint32_t addr)
 {
     addr = MirrorAddress(addr);
-    if (addr <= 0x200000)
+    if (addr < RAM_SIZE)
     {
         return ram[addr];
     }
-    else if (addr >= 0x1F000000 && addr <= 0x1F800000)
+    else if (addr >= 0x1F800000 && addr < 0x1F800000 + SCRATCHPAD_SIZE)
+    {
+        return scratchpad[addr - 0x1F800000];
+    }
+    else if (addr >= 0x1F000000 && addr < 0x1F800000)
     {
         return 0xFF;
     }
-    else if (addr >= 0x1FC00000 && addr <= 0x1FC80000)
+    else if (addr >= 0x1F801800 && addr <= 0x1F801803)
+    {
+        return cdrom->Read(addr);
+    }
+    else if (addr >= 0x1FC00000 && addr < 0x1FC00000 + BIOS_SIZE)
     {
         return bios[addr - 0x1FC00000];
     }
     else
     {
-        spdlog::error("Unknown memory read from {:08X}", addr);
-        exit(0);
+        logger->error("Unknown memory read from {:08X}", addr);
+        Stop(StopReason::UnknownMemoryRead);
         return 0;
     }
 }
@@ -50,10 +587,19 @@ uint16_t PSX::ReadMemory16(uint32_t addr)
     if (addr % 2 != 0)
     {
         cpu->Exception(ExceptionType::LoadAddressError);
-        spdlog::error("Memory is not alligned {:08X}", addr);
+        logger->error("Memory is not alligned {:08X}", addr);
         return 0;
     }
 
+    if (addr == 0x1F801070)
+    {
+        return i_stat;
+    }
+    else if (addr == 0x1F801074)
+    {
+        return i_mask;
+    }
+
     return ReadMemory8(addr + 1) << 8 | ReadMemory8(addr);
 }
 
@@ -62,17 +608,17 @@ uint32_t PSX::ReadMemory32(uint32_t addr)
     if (addr % 4 != 0)
     {
         cpu->Exception(ExceptionType::LoadAddressError);
-        spdlog::error("Memory is not alligned {:08X}", addr);
+        logger->error("Memory is not alligned {:08X}", addr);
         return 0;
     }
 
     if (addr == 0x1F801070)
     {
-        return 0x0;
+        return i_stat;
     }
     else if (addr == 0x1F801074)
     {
-        return 0x0;
+        return i_mask;
     }
     else
     {
@@ -83,18 +629,27 @@ uint32_t PSX::ReadMemory32(uint32_t addr)
 void PSX::WriteMemory8(uint32_t addr, uint8_t value)
 {
     addr = MirrorAddress(addr);
-    if (addr <= 0x200000)
+    if (addr < RAM_SIZE)
     {
         ram[addr] = value;
+        dirty_pages[addr / RAM_PAGE_SIZE] = true;
+    }
+    else if (addr >= 0x1F800000 && addr < 0x1F800000 + SCRATCHPAD_SIZE)
+    {
+        scratchpad[addr - 0x1F800000] = value;
+    }
+    else if (addr >= 0x1F801800 && addr <= 0x1F801803)
+    {
+        cdrom->Write(addr, value);
     }
     else if (addr == 0x1F802041)
     {
-        spdlog::info("BIOS Boot Progress: {:X}", value);
+        logger->info("BIOS Boot Progress: {:X}", value);
     }
     else
     {
-        spdlog::error("Unknown memory write to {:08X} with value {:02X}", addr, value);
-        exit(0);
+        logger->error("Unknown memory write to {:08X} with value {:02X}", addr, value);
+        Stop(StopReason::UnknownMemoryWrite);
     }
 }
 
@@ -103,17 +658,25 @@ void PSX::WriteMemory16(uint32_t addr, uint16_t value)
     if (addr % 2 != 0)
     {
         cpu->Exception(ExceptionType::StoreAddressError);
-        spdlog::error("Memory is not alligned {:04X}", addr);
+        logger->error("Memory is not alligned {:04X}", addr);
         return;
     }
 
-    if (addr >= 0x1F801100 && addr <= 0x1F801128)
+    if (addr == 0x1F801070)
+    {
+        i_stat &= value;
+    }
+    else if (addr == 0x1F801074)
+    {
+        i_mask = value & 0x7FF;
+    }
+    else if (addr >= 0x1F801100 && addr <= 0x1F801128)
     {
-        spdlog::warn("Unimplemented Timer Register: {:08X}", addr);
+        UnimplementedWrite("Timer", addr, value, 2);
     }
     else if (addr >= 0x1F801D80 && addr <= 0x1F801D86)
     {
-        spdlog::warn("Unimplemented SPU Register: {:08X}", addr);
+        UnimplementedWrite("SPU", addr, value, 2);
     }
     else
     {
@@ -127,25 +690,25 @@ void PSX::WriteMemory32(uint32_t addr, uint32_t value)
     if (addr % 4 != 0)
     {
         cpu->Exception(ExceptionType::StoreAddressError);
-        spdlog::error("Memory is not alligned {:08X}", addr);
+        logger->error("Memory is not alligned {:08X}", addr);
         return;
     }
 
     if (addr >= 0x1F801000 && addr <= 0x1F801060)
     {
-        spdlog::warn("Unimplemented Memory Control Register: {:08X}", addr);
+        UnimplementedWrite("Memory Control", addr, value, 4);
     }
     else if (addr == 0x1F801070)
     {
-        spdlog::warn("Unimplemented IRQ Stat Register: {:08X}", addr);
+        i_stat &= value;
     }
     else if (addr == 0x1F801074)
     {
-        spdlog::warn("Unimplemented IRQ Mask Register: {:08X}", addr);
+        i_mask = value & 0x7FF;
     }
     else if (addr == 0xFFFE0130)
     {
-        spdlog::warn("Unimplemented Cache Control Register: {:08X}", addr);
+        UnimplementedWrite("Cache Control", addr, value, 4);
     }
     else
     {
@@ -160,7 +723,7 @@ uint32_t PSX::MirrorAddress(uint32_t addr)
     if (index > 1 && index < 4)
     {
         cpu->Exception(ExceptionType::LoadAddressError);
-        spdlog::error("Attempted to access forbidden part of KUSEG");
+        logger->error("Attempted to access forbidden part of KUSEG");
     }
     else if (index == 4)
     {
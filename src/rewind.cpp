@@ -0,0 +1,266 @@
+#include "rewind.hpp"
+#include "psx.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+RewindBuffer::RewindBuffer(PSX *psx, size_t capacity, int interval) : psx(psx), capacity(capacity), interval(interval)
+{
+    shadow_ram.resize(RAM_SIZE);
+    memory_usage = shadow_ram.size();
+
+    // The first capture has to see all of RAM to serve as the base
+    psx->GetDirtyPages().set();
+
+    thread = std::thread(&RewindBuffer::Worker, this);
+}
+
+RewindBuffer::~RewindBuffer()
+{
+    {
+        std::lock_guard lock(mutex);
+        running = false;
+    }
+    condition.notify_one();
+    thread.join();
+}
+
+void RewindBuffer::OnFrame()
+{
+    if (++frames < interval)
+        return;
+
+    frames = 0;
+    Take();
+}
+
+bool RewindBuffer::StepBack()
+{
+    Flush();
+    if (!has_base)
+        return false;
+
+    // The first step only returns to the newest snapshot if the machine moved on since. A frame cut
+    // short by a stop never reaches OnFrame, so the instruction count tells, not the frame count.
+    if (psx->GetInstructionCount() == position)
+    {
+        Snapshot snapshot;
+        {
+            std::lock_guard lock(mutex);
+            if (snapshots.empty())
+                return false;
+
+            snapshot = std::move(snapshots.back());
+            snapshots.pop_back();
+            memory_usage -= snapshot.data.size() + sizeof(Snapshot);
+            memory_usage += snapshot.device_size - shadow_device.size();
+        }
+
+        const uint8_t *delta = snapshot.data.data();
+        shadow_device.resize(snapshot.device_delta_size);
+        delta = ApplyDelta(delta, shadow_device.data(), snapshot.device_delta_size);
+        shadow_device.resize(snapshot.device_size);
+
+        while (delta < snapshot.data.data() + snapshot.data.size())
+        {
+            uint16_t page;
+            std::memcpy(&page, delta, sizeof(page));
+            delta = ApplyDelta(delta + sizeof(page), shadow_ram.data() + page * RAM_PAGE_SIZE, RAM_PAGE_SIZE);
+        }
+    }
+
+    return Restore();
+}
+
+size_t RewindBuffer::GetSnapshotCount()
+{
+    std::lock_guard lock(mutex);
+    return snapshots.size() + has_base;
+}
+
+size_t RewindBuffer::GetMemoryUsage()
+{
+    std::lock_guard lock(mutex);
+    return memory_usage;
+}
+
+void RewindBuffer::Take()
+{
+    Capture capture;
+    position = psx->GetInstructionCount();
+
+    writer.Reset();
+    psx->SaveState(writer, false);
+    capture.device.assign(writer.GetData(), writer.GetData() + writer.GetSize());
+
+    auto &dirty_pages = psx->GetDirtyPages();
+    const uint8_t *ram = psx->GetRAM();
+    for (int page = 0; page < RAM_PAGES; page++)
+    {
+        if (!dirty_pages[page])
+            continue;
+
+        capture.pages.push_back(page);
+        capture.ram.insert(capture.ram.end(), ram + page * RAM_PAGE_SIZE, ram + (page + 1) * RAM_PAGE_SIZE);
+    }
+    dirty_pages.reset();
+
+    {
+        std::lock_guard lock(mutex);
+        queue.push_back(std::move(capture));
+    }
+    condition.notify_one();
+}
+
+void RewindBuffer::Worker()
+{
+    std::unique_lock lock(mutex);
+    while (true)
+    {
+        condition.wait(lock, [this]
+                       { return !running || !queue.empty(); });
+        if (queue.empty())
+            break;
+
+        auto capture = std::move(queue.front());
+        queue.pop_front();
+        busy = true;
+
+        lock.unlock();
+        Process(capture);
+        lock.lock();
+
+        busy = false;
+        idle.notify_all();
+    }
+}
+
+void RewindBuffer::Process(Capture &capture)
+{
+    if (!has_base)
+    {
+        shadow_device = capture.device;
+        for (size_t i = 0; i < capture.pages.size(); i++)
+            std::memcpy(shadow_ram.data() + capture.pages[i] * RAM_PAGE_SIZE, capture.ram.data() + i * RAM_PAGE_SIZE, RAM_PAGE_SIZE);
+
+        std::lock_guard lock(mutex);
+        memory_usage += shadow_device.size();
+        has_base = true;
+        return;
+    }
+
+    // Deltas turn the new snapshot back into the previous one, device state may change in size
+    Snapshot snapshot;
+    snapshot.device_size = shadow_device.size();
+    snapshot.device_delta_size = std::max(shadow_device.size(), capture.device.size());
+
+    auto device = capture.device;
+    device.resize(snapshot.device_delta_size);
+    shadow_device.resize(snapshot.device_delta_size);
+    EncodeDelta(device.data(), shadow_device.data(), snapshot.device_delta_size, snapshot.data);
+    shadow_device = std::move(capture.device);
+    size_t device_growth = shadow_device.size() - snapshot.device_size;
+
+    for (size_t i = 0; i < capture.pages.size(); i++)
+    {
+        const uint8_t *current = capture.ram.data() + i * RAM_PAGE_SIZE;
+        uint8_t *previous = shadow_ram.data() + capture.pages[i] * RAM_PAGE_SIZE;
+        if (std::memcmp(current, previous, RAM_PAGE_SIZE) == 0)
+            continue;
+
+        uint16_t page = capture.pages[i];
+        snapshot.data.insert(snapshot.data.end(), reinterpret_cast<uint8_t *>(&page), reinterpret_cast<uint8_t *>(&page) + sizeof(page));
+        EncodeDelta(current, previous, RAM_PAGE_SIZE, snapshot.data);
+        std::memcpy(previous, current, RAM_PAGE_SIZE);
+    }
+    snapshot.data.shrink_to_fit();
+
+    std::lock_guard lock(mutex);
+    memory_usage += snapshot.data.size() + sizeof(Snapshot) + device_growth;
+    snapshots.push_back(std::move(snapshot));
+
+    while (memory_usage > capacity && !snapshots.empty())
+    {
+        memory_usage -= snapshots.front().data.size() + sizeof(Snapshot);
+        snapshots.pop_front();
+    }
+}
+
+void RewindBuffer::Flush()
+{
+    std::unique_lock lock(mutex);
+    idle.wait(lock, [this]
+              { return queue.empty() && !busy; });
+}
+
+bool RewindBuffer::Restore()
+{
+    // A refused snapshot leaves the machine as it was, RAM included
+    StateReader reader(shadow_device.data(), shadow_device.size(), psx->GetLogger());
+    if (!psx->LoadState(reader, false))
+        return false;
+
+    std::memcpy(psx->GetRAM(), shadow_ram.data(), RAM_SIZE);
+    psx->GetDirtyPages().reset();
+    frames = 0;
+    position = psx->GetInstructionCount();
+    return true;
+}
+
+void RewindBuffer::EncodeDelta(const uint8_t *current, const uint8_t *previous, size_t size, std::vector<uint8_t> &out)
+{
+    // XOR deltas are mostly zero, so they are stored as pairs of zero runs and literal runs
+    size_t i = 0;
+    while (i < size)
+    {
+        uint16_t zeros = 0;
+        while (i < size && zeros < 0xFFFF && current[i] == previous[i])
+        {
+            zeros++;
+            i++;
+        }
+
+        size_t start = i;
+        uint16_t literals = 0;
+        while (i < size && literals < 0xFFFF)
+        {
+            // Short matches are cheaper to keep inside the literal run than to split it
+            size_t run = 0;
+            while (i + run < size && run < 4 && current[i + run] == previous[i + run])
+                run++;
+            if (run == 4 || (run > 0 && i + run == size))
+                break;
+
+            i++;
+            literals++;
+        }
+
+        size_t offset = out.size();
+        out.resize(offset + 4 + literals);
+        std::memcpy(out.data() + offset, &zeros, sizeof(zeros));
+        std::memcpy(out.data() + offset + 2, &literals, sizeof(literals));
+        for (size_t j = 0; j < literals; j++)
+            out[offset + 4 + j] = current[start + j] ^ previous[start + j];
+    }
+}
+
+const uint8_t *RewindBuffer::ApplyDelta(const uint8_t *delta, uint8_t *target, size_t size)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        uint16_t zeros;
+        uint16_t literals;
+        std::memcpy(&zeros, delta, sizeof(zeros));
+        std::memcpy(&literals, delta + 2, sizeof(literals));
+        delta += 4;
+
+        i += zeros;
+        for (size_t j = 0; j < literals; j++)
+            target[i + j] ^= delta[j];
+
+        i += literals;
+        delta += literals;
+    }
+    return delta;
+}
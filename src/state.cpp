@@ -0,0 +1,141 @@
+#include "state.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+StateWriter::StateWriter()
+{
+    Reset();
+}
+
+void StateWriter::Reset()
+{
+    // The buffer is kept around, so repeated snapshots never reallocate
+    size = 0;
+    sections = 0;
+    Write(StateHeader{STATE_MAGIC, STATE_VERSION, 0});
+}
+
+void StateWriter::BeginSection(const char *id, uint32_t version)
+{
+    section_start = size;
+
+    SectionHeader header{{}, version, 0};
+    std::memcpy(header.id, id, sizeof(header.id));
+    Write(header);
+}
+
+void StateWriter::EndSection()
+{
+    uint32_t length = size - section_start - sizeof(SectionHeader);
+    std::memcpy(buffer.data() + section_start + offsetof(SectionHeader, size), &length, sizeof(length));
+
+    sections++;
+    std::memcpy(buffer.data() + offsetof(StateHeader, sections), &sections, sizeof(sections));
+}
+
+void StateWriter::WriteBytes(const void *data, size_t length)
+{
+    if (size + length > buffer.size())
+        buffer.resize(std::max(buffer.size() * 2, size + length));
+
+    std::memcpy(buffer.data() + size, data, length);
+    size += length;
+}
+
+const uint8_t *StateWriter::GetData()
+{
+    return buffer.data();
+}
+
+size_t StateWriter::GetSize()
+{
+    return size;
+}
+
+StateReader::StateReader(const uint8_t *data, size_t size, spdlog::logger *logger) : data(data), logger(logger ? logger : spdlog::default_logger_raw())
+{
+    StateHeader header;
+    if (size < sizeof(header))
+    {
+        this->logger->error("Save state is truncated");
+        return;
+    }
+
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != STATE_MAGIC)
+    {
+        this->logger->error("Not a save state");
+        return;
+    }
+    if (header.version != STATE_VERSION)
+    {
+        this->logger->error("Unsupported save state version {}", header.version);
+        return;
+    }
+
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.sections; i++)
+    {
+        SectionHeader section;
+        if (offset + sizeof(section) > size)
+        {
+            this->logger->error("Save state is truncated");
+            return;
+        }
+
+        std::memcpy(&section, data + offset, sizeof(section));
+        offset += sizeof(section);
+        if (offset + section.size > size)
+        {
+            this->logger->error("Save state is truncated");
+            return;
+        }
+
+        sections[std::string(section.id, sizeof(section.id))] = {section.version, offset, section.size};
+        offset += section.size;
+    }
+
+    valid = true;
+}
+
+bool StateReader::IsValid()
+{
+    return valid;
+}
+
+bool StateReader::OpenSection(const char *id, uint32_t max_version, uint32_t &version)
+{
+    auto entry = sections.find(std::string(id, 4));
+    if (entry == sections.end())
+    {
+        logger->error("Save state is missing section {}", std::string(id, 4));
+        return false;
+    }
+    if (entry->second.version > max_version)
+    {
+        logger->error("Save state section {} has unsupported version {}", std::string(id, 4), entry->second.version);
+        return false;
+    }
+
+    version = entry->second.version;
+    position = entry->second.offset;
+    section_end = entry->second.offset + entry->second.size;
+    return true;
+}
+
+bool StateReader::ReadBytes(void *buffer, size_t length)
+{
+    if (position + length > section_end)
+    {
+        logger->error("Save state section is truncated");
+        return false;
+    }
+
+    std::memcpy(buffer, data + position, length);
+    position += length;
+    return true;
+}
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "psx.hpp"
+
+#include "spdlog/fmt/fmt.h"
+
+#define STALLED_AFTER 2000000000ull
+
+static const char *region_names[] = {"RAM", "BIOS", "Scratchpad", "MMIO"};
+
+struct Snapshot
+{
+    bool valid = false;
+    std::string name;
+    int32_t pid = 0;
+    StopReason stop_reason = StopReason::None;
+    uint64_t updated = 0;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+    uint64_t frame_time = 0;
+    uint64_t total_frame_time = 0;
+    uint64_t unimplemented_registers = 0;
+    uint64_t exceptions[EXCEPTION_TYPES]{};
+    uint64_t reads[(int)MemoryRegion::Count]{};
+    uint64_t writes[(int)MemoryRegion::Count]{};
+};
+
+// The file is read like any other, the kernel serves it from the pages the instance writes to
+static Snapshot ReadSnapshot(const std::string &path)
+{
+    Snapshot snapshot;
+    alignas(Stats) char buffer[sizeof(Stats)];
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read(buffer, sizeof(buffer)))
+        return snapshot;
+
+    auto stats = reinterpret_cast<const Stats *>(buffer);
+    if (stats->magic != STATS_MAGIC || stats->version != STATS_VERSION)
+        return snapshot;
+
+    snapshot.valid = true;
+    snapshot.name.assign(stats->name, strnlen(stats->name, STATS_NAME_SIZE));
+    snapshot.pid = stats->pid;
+    snapshot.stop_reason = (StopReason)stats->stop_reason.load();
+    snapshot.updated = stats->updated.load();
+    snapshot.instructions = stats->instructions.load();
+    snapshot.frames = stats->frames.load();
+    snapshot.frame_time = stats->frame_time.load();
+    snapshot.total_frame_time = stats->total_frame_time.load();
+    snapshot.unimplemented_registers = stats->unimplemented_registers.load();
+    for (int i = 0; i < EXCEPTION_TYPES; i++)
+        snapshot.exceptions[i] = stats->exceptions[i].load();
+    for (int i = 0; i < (int)MemoryRegion::Count; i++)
+    {
+        snapshot.reads[i] = stats->reads[i].load();
+        snapshot.writes[i] = stats->writes[i].load();
+    }
+    return snapshot;
+}
+
+struct Row
+{
+    Snapshot current;
+    std::string status;
+    double mips = 0.0;
+    double fps = 0.0;
+    double frame_ms = 0.0;
+    uint64_t exceptions = 0;
+    double reads[(int)MemoryRegion::Count]{};
+    double writes[(int)MemoryRegion::Count]{};
+};
+
+static void Print(const std::vector<std::string> &paths, double interval, bool detail)
+{
+    std::vector<Snapshot> before;
+    for (auto &path : paths)
+        before.push_back(ReadSnapshot(path));
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::vector<Row> rows;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        Snapshot current = ReadSnapshot(paths[i]);
+        if (!current.valid)
+        {
+            std::cerr << "Invalid stats file " << paths[i] << std::endl;
+            continue;
+        }
+
+        // An instance that restarted in between has nothing to compare against
+        Snapshot &previous = before[i].valid && before[i].pid == current.pid && before[i].instructions <= current.instructions ? before[i] : current;
+
+        Row row;
+        row.mips = (current.instructions - previous.instructions) / elapsed / 1e6;
+        row.fps = (current.frames - previous.frames) / elapsed;
+        uint64_t frames = current.frames - previous.frames;
+        row.frame_ms = frames ? (current.total_frame_time - previous.total_frame_time) / 1e6 / frames : current.frame_time / 1e6;
+        for (int type = 0; type < EXCEPTION_TYPES; type++)
+            row.exceptions += current.exceptions[type];
+        for (int region = 0; region < (int)MemoryRegion::Count; region++)
+        {
+            row.reads[region] = (current.reads[region] - previous.reads[region]) / elapsed;
+            row.writes[region] = (current.writes[region] - previous.writes[region]) / elapsed;
+        }
+
+        if (current.stop_reason != StopReason::None)
+            row.status = GetStopReasonName(current.stop_reason);
+        else if (now - current.updated > STALLED_AFTER)
+            row.status = "Stalled";
+        else
+            row.status = "Running";
+
+        row.current = std::move(current);
+        rows.push_back(std::move(row));
+    }
+
+    // Slowest instances first, those are the ones worth looking at
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b)
+              { return a.fps < b.fps; });
+
+    std::cout << fmt::format("{:<24} {:>8} {:<20} {:>8} {:>7} {:>7} {:>9} {:>11} {:>8}",
+                             "NAME", "PID", "STATUS", "MIPS", "FPS", "SPEED", "FRAME MS", "EXCEPTIONS", "UNIMPL")
+              << std::endl;
+    for (auto &row : rows)
+    {
+        auto &snapshot = row.current;
+        std::cout << fmt::format("{:<24} {:>8} {:<20} {:>8.2f} {:>7.1f} {:>6.0f}% {:>9.2f} {:>11} {:>8}",
+                                 snapshot.name.substr(0, 24), snapshot.pid, row.status, row.mips, row.fps, row.fps / 60 * 100,
+                                 row.frame_ms, row.exceptions, snapshot.unimplemented_registers)
+                  << std::endl;
+
+        if (!detail)
+            continue;
+
+        for (int region = 0; region < (int)MemoryRegion::Count; region++)
+            std::cout << fmt::format("    {:<10} {:>12.0f} reads/s {:>12.0f} writes/s", region_names[region], row.reads[region], row.writes[region]) << std::endl;
+        for (int type = 0; type < EXCEPTION_TYPES; type++)
+            if (snapshot.exceptions[type])
+                std::cout << fmt::format("    exception {:02X}h {:>12}", type, snapshot.exceptions[type]) << std::endl;
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    std::vector<std::string> paths;
+    double interval = 1.0;
+    bool watch = false;
+    bool detail = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--interval" && i + 1 < argc)
+            interval = std::stod(argv[++i]);
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg == "--detail")
+            detail = true;
+        else
+            paths.push_back(arg);
+    }
+
+    if (paths.empty())
+    {
+        std::cerr << "Usage: psx_top [stats files...] [--interval seconds] [--watch] [--detail]" << std::endl;
+        return 1;
+    }
+
+    do
+    {
+        if (watch)
+            std::cout << "\x1B[H\x1B[2J";
+        Print(paths, interval, detail);
+    } while (watch);
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+
+const char *GetTraceEventName(TraceEvent event)
+{
+    switch (event)
+    {
+    case TraceEvent::CacheIsolatedLoad:
+        return "CacheIsolatedLoad";
+    case TraceEvent::CacheIsolatedStore:
+        return "CacheIsolatedStore";
+    case TraceEvent::UnimplementedWrite:
+        return "UnimplementedWrite";
+    case TraceEvent::Exception:
+        return "Exception";
+    case TraceEvent::Interrupt:
+        return "Interrupt";
+    case TraceEvent::CDROMCommand:
+        return "CDROMCommand";
+    }
+    return "Unknown";
+}
+
+TraceBuffer::TraceBuffer(const std::string &path, size_t capacity) : records(std::bit_ceil(capacity)), file(path, std::ios::binary)
+{
+    TraceFileHeader header{TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord)};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    // Checked before the drain thread starts, the stream belongs to it from then on
+    open = file.good();
+    if (open)
+        thread = std::thread(&TraceBuffer::Worker, this);
+}
+
+TraceBuffer::~TraceBuffer()
+{
+    if (!open)
+        return;
+
+    {
+        std::lock_guard lock(mutex);
+        running = false;
+    }
+    condition.notify_one();
+    thread.join();
+
+    Drain();
+}
+
+bool TraceBuffer::IsOpen()
+{
+    return open;
+}
+
+uint64_t TraceBuffer::GetDropped()
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+void TraceBuffer::Worker()
+{
+    std::unique_lock lock(mutex);
+    while (running)
+    {
+        lock.unlock();
+        Drain();
+        lock.lock();
+
+        // Polling keeps the producer free of any notification, a few milliseconds of
+        // latency is far below what it takes to fill the ring
+        condition.wait_for(lock, std::chrono::milliseconds(2), [this]
+                           { return !running; });
+    }
+}
+
+void TraceBuffer::Drain()
+{
+    uint64_t start = tail.load(std::memory_order_relaxed);
+    uint64_t end = head.load(std::memory_order_acquire);
+    size_t mask = records.size() - 1;
+
+    while (start != end)
+    {
+        size_t index = start & mask;
+        size_t count = std::min<uint64_t>(end - start, records.size() - index);
+        file.write(reinterpret_cast<const char *>(&records[index]), count * sizeof(TraceRecord));
+        start += count;
+        tail.store(start, std::memory_order_release);
+    }
+    file.flush();
+}
@@ -0,0 +1,75 @@
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "trace.hpp"
+
+#include "spdlog/fmt/fmt.h"
+
+static const char *interrupt_names[] = {"VBlank", "GPU", "CDROM", "DMA", "Timer0", "Timer1", "Timer2", "Controller", "SIO", "SPU", "Lightpen"};
+
+static std::string Describe(const TraceRecord &record)
+{
+    switch (record.event)
+    {
+    case TraceEvent::CacheIsolatedLoad:
+        return fmt::format("load{} from {:08X} ignored, cache is isolated", record.size * 8, record.addr);
+    case TraceEvent::CacheIsolatedStore:
+        return fmt::format("store{} of {:0{}X} to {:08X} ignored, cache is isolated", record.size * 8, record.value, record.size * 2, record.addr);
+    case TraceEvent::UnimplementedWrite:
+        return fmt::format("write{} of {:0{}X} to unimplemented register {:08X}", record.size * 8, record.value, record.size * 2, record.addr);
+    case TraceEvent::Exception:
+        return fmt::format("exception {:X}h, jumping to {:08X}", record.value, record.addr);
+    case TraceEvent::Interrupt:
+        return fmt::format("{} interrupt requested", record.value < std::size(interrupt_names) ? interrupt_names[record.value] : "unknown");
+    case TraceEvent::CDROMCommand:
+        return fmt::format("command {:02X}h with {} parameters", record.value, record.size);
+    }
+    return fmt::format("event {} addr {:08X} value {:08X}", (int)record.event, record.addr, record.value);
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: psx_tracedump [trace file] [--event name]" << std::endl;
+        return 1;
+    }
+
+    std::string filter;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if (arg == "--event")
+            filter = argv[i + 1];
+    }
+
+    std::ifstream file(argv[1], std::ios::binary);
+    TraceFileHeader header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != TRACE_MAGIC)
+    {
+        std::cerr << "Invalid trace file" << std::endl;
+        return 1;
+    }
+    if (header.version > TRACE_VERSION || header.record_size != sizeof(TraceRecord))
+    {
+        std::cerr << "Unsupported trace version " << header.version << std::endl;
+        return 1;
+    }
+
+    TraceRecord record;
+    uint64_t count = 0;
+    while (file.read(reinterpret_cast<char *>(&record), sizeof(record)))
+    {
+        const char *name = GetTraceEventName(record.event);
+        if (!filter.empty() && filter != name)
+            continue;
+
+        std::cout << fmt::format("{:>12} {:08X} {:08X} {:<18} {}", record.instruction, record.pc, record.opcode, name, Describe(record)) << std::endl;
+        count++;
+    }
+
+    std::cerr << count << " events" << std::endl;
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "warmstart.hpp"
+#include "psx.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <system_error>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "spdlog/fmt/fmt.h"
+
+WarmImage::WarmImage(PSX *psx)
+{
+    StateWriter writer;
+    psx->SaveState(writer, false);
+    device.assign(writer.GetData(), writer.GetData() + writer.GetSize());
+
+#ifdef __linux__
+    fd = memfd_create("psx-warm-ram", MFD_CLOEXEC);
+    if (fd >= 0 && write(fd, psx->GetRAM(), RAM_SIZE) == RAM_SIZE)
+        return;
+
+    psx->GetLogger()->warn("Failed to create shared RAM image, falling back to copies");
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+#endif
+
+    ram.assign(psx->GetRAM(), psx->GetRAM() + RAM_SIZE);
+}
+
+WarmImage::~WarmImage()
+{
+#ifdef __linux__
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+std::unique_ptr<PSX> WarmImage::Spawn(uint8_t *bios, std::shared_ptr<spdlog::logger> logger, std::unique_ptr<Disc> disc)
+{
+    auto psx = std::make_unique<PSX>(bios, logger);
+    if (disc)
+        psx->InsertDisc(std::move(disc));
+
+    bool mapped = false;
+#ifdef __linux__
+    mapped = fd >= 0 && (psx->MapRAM(fd) || pread(fd, psx->GetRAM(), RAM_SIZE, 0) == RAM_SIZE);
+#endif
+    if (!mapped)
+    {
+        if (ram.empty())
+            return nullptr;
+        std::memcpy(psx->GetRAM(), ram.data(), RAM_SIZE);
+    }
+
+    StateReader reader(device.data(), device.size(), psx->GetLogger());
+    if (!psx->LoadState(reader, false))
+        return nullptr;
+    return psx;
+}
+
+bool BootCached(PSX &psx, const std::string &cache_directory, uint32_t addr, uint64_t max_cycles)
+{
+    // The BIOS boots differently with a disc inserted and the state keeps the disc, so every disc gets its own
+    // entry. States from older cores still load, the revision keeps their boots from being reused.
+    auto disc = psx.HasDisc() ? fmt::format("-{:016X}", psx.GetDiscHash()) : "";
+    auto name = fmt::format("boot-r{}-{:016X}-{:08X}{}.state", CORE_REVISION, psx.GetBIOSHash(), addr, disc);
+    auto path = std::filesystem::path(cache_directory) / name;
+
+    std::error_code error;
+    if (std::filesystem::exists(path, error))
+    {
+        if (psx.LoadStateFromFile(path.string()))
+        {
+            psx.GetLogger()->info("Started from boot cache {}", path.string());
+            return true;
+        }
+        psx.GetLogger()->error("Removing unusable boot cache {}", path.string());
+        std::filesystem::remove(path, error);
+        return false;
+    }
+
+    if (!psx.RunUntil(addr, max_cycles))
+        return false;
+
+    // Written under a unique name and renamed, so concurrent instances never see half a file
+    std::filesystem::create_directories(cache_directory, error);
+    auto temporary = path;
+    temporary += fmt::format(".{:08X}.tmp", std::random_device()());
+    if (!psx.SaveStateToFile(temporary.string()))
+    {
+        std::filesystem::remove(temporary, error);
+        return true;
+    }
+
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+    {
+        psx.GetLogger()->warn("Failed to store boot cache {}: {}", path.string(), error.message());
+        std::filesystem::remove(temporary, error);
+    }
+    return true;
+}
@@ -0,0 +1,77 @@
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "psx.hpp"
+
+// Stores an incrementing counter to consecutive RAM words, so every frame dirties new pages
+static const uint32_t program[] = {
+    0x3C088001, // lui   t0, 0x8001
+    0x25290001, // addiu t1, t1, 1
+    0xAD090000, // sw    t1, 0(t0)
+    0x25080004, // addiu t0, t0, 4
+    0x0BF00001, // j     0xBFC00004
+    0x00000000, // nop
+};
+
+static std::vector<uint8_t> Save(PSX &psx)
+{
+    StateWriter writer;
+    psx.SaveState(writer);
+    return std::vector<uint8_t>(writer.GetData(), writer.GetData() + writer.GetSize());
+}
+
+int main()
+{
+    std::vector<uint8_t> bios(BIOS_SIZE);
+    std::memcpy(bios.data(), program, sizeof(program));
+
+    PSX psx(bios.data());
+    psx.EnableRewind(16 << 20, 2);
+
+    psx.Run(0, 10);
+    auto expected = Save(psx);
+
+    // Moves on past the next snapshot and scribbles over memory the program never touches
+    psx.Run(0, 3);
+    psx.WriteMemory32(0x80000000, 0xDEADBEEF);
+
+    // The first step returns to the snapshot at frame 12, the second one to frame 10
+    if (!psx.StepBack() || !psx.StepBack())
+    {
+        std::cerr << "Stepping back failed" << std::endl;
+        return 1;
+    }
+
+    if (Save(psx) != expected)
+    {
+        std::cerr << "Machine after stepping back differs from the saved one" << std::endl;
+        return 1;
+    }
+
+    // Only the snapshots at frames 2 to 8 are left
+    int steps = 0;
+    while (psx.StepBack())
+        steps++;
+    if (steps != 4)
+    {
+        std::cerr << "Expected 4 older snapshots, stepped back " << steps << " times" << std::endl;
+        return 1;
+    }
+
+    // A stop partway through the frame after a snapshot goes back to that snapshot, not the one before
+    PSX stopped(bios.data());
+    stopped.EnableRewind(16 << 20, 2);
+    stopped.Run(0, 4);
+    expected = Save(stopped);
+
+    stopped.Run(1000);
+    if (!stopped.StepBack() || Save(stopped) != expected)
+    {
+        std::cerr << "Stepping back from a stop mid frame missed the newest snapshot" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}